@@ -1,25 +1,136 @@
 #pragma once
 
 #include <byteswap.h>
+#include <cstring>
 
 #include "record.h"
 #include "util.h"
 
-inline bool cmp_header(const Header& lhs, const Header& rhs)
+// unaligned loads that do not violate strict aliasing (compile to a single mov)
+inline uint64_t load_u64(const uint8_t* data)
 {
-    const uint64_t a = bswap_64(*reinterpret_cast<const uint64_t*>(&lhs[0]));
-    const uint64_t b = bswap_64(*reinterpret_cast<const uint64_t*>(&rhs[0]));
+    uint64_t value;
+    std::memcpy(&value, data, sizeof(value));
+    return value;
+}
+inline uint32_t load_u32(const uint8_t* data)
+{
+    uint32_t value;
+    std::memcpy(&value, data, sizeof(value));
+    return value;
+}
+inline uint16_t load_u16(const uint8_t* data)
+{
+    uint16_t value;
+    std::memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+// big-endian value of the key bytes that follow the last whole 8-byte word of the key
+template <size_t KeySize>
+inline uint64_t load_key_tail(const uint8_t* key)
+{
+    const uint8_t* tail = key + KeySize / 8 * 8;
+    switch (KeySize % 8)
+    {
+        case 0: return 0;
+        case 2: return bswap_16(load_u16(tail));
+        case 4: return bswap_32(load_u32(tail));
+        default:
+        {
+            uint64_t value = 0;
+            for (size_t i = 0; i < KeySize % 8; i++)
+            {
+                value = (value << 8) | tail[i];
+            }
+            return value;
+        }
+    }
+}
+
+template <size_t KeySize>
+inline bool cmp_header(const std::array<uint8_t, KeySize>& lhs, const std::array<uint8_t, KeySize>& rhs)
+{
+    for (size_t i = 0; i < KeySize / 8; i++)
+    {
+        const uint64_t a = bswap_64(load_u64(&lhs[i * 8]));
+        const uint64_t b = bswap_64(load_u64(&rhs[i * 8]));
+        if (a != b) return a < b;
+    }
+    return load_key_tail<KeySize>(lhs.data()) < load_key_tail<KeySize>(rhs.data());
+}
+
+// normalized key, compared with plain integer comparisons
+template <size_t KeySize>
+struct MergeKey {
+    static constexpr size_t WORDS = KeySize / 8;
+    // tail value of an exhausted run, it is larger than the tail of any key
+    static constexpr uint64_t EXHAUSTED = 1ull << (8 * (KeySize % 8));
+
+    static MergeKey exhausted()
+    {
+        MergeKey key;
+        key.prefix.fill(UINT64_MAX);
+        key.tail = EXHAUSTED;
+        return key;
+    }
 
-    if (a == b)
+    bool operator<(const MergeKey& other) const
     {
-        const uint16_t c = bswap_16(*reinterpret_cast<const uint16_t*>(&lhs[8]));
-        const uint16_t d = bswap_16(*reinterpret_cast<const uint16_t*>(&rhs[8]));
-        return c < d;
+        for (size_t i = 0; i < WORDS; i++)
+        {
+            if (this->prefix[i] != other.prefix[i]) return this->prefix[i] < other.prefix[i];
+        }
+        return this->tail < other.tail;
     }
-    return a < b;
+    bool operator==(const MergeKey& other) const
+    {
+        return this->prefix == other.prefix && this->tail == other.tail;
+    }
+
+    uint8_t first_byte() const
+    {
+        return WORDS > 0 ? static_cast<uint8_t>(this->prefix[0] >> 56)
+                         : static_cast<uint8_t>(this->tail >> (8 * (KeySize % 8 ? KeySize % 8 : 1) - 8));
+    }
+
+    std::array<uint64_t, WORDS> prefix;
+    uint64_t tail;  // the last KeySize % 8 key bytes
+};
+
+template <size_t KeySize>
+inline MergeKey<KeySize> make_merge_key(const std::array<uint8_t, KeySize>& header)
+{
+    MergeKey<KeySize> key;
+    for (size_t i = 0; i < KeySize / 8; i++)
+    {
+        key.prefix[i] = bswap_64(load_u64(&header[i * 8]));
+    }
+    key.tail = load_key_tail<KeySize>(header.data());
+    return key;
 }
 
+template <typename Record>
 inline bool cmp_record(const Record& lhs, const Record& rhs)
 {
-    return cmp_header(*(reinterpret_cast<const Header*>(&lhs)), *(reinterpret_cast<const Header*>(&rhs)));
+    return cmp_header(get_header(lhs), get_header(rhs));
+}
+
+template <typename Record>
+bool is_sorted(const Record* records, size_t count)
+{
+    for (size_t i = 1; i < count; i++)
+    {
+        if (!cmp_record(records[i - 1], records[i])) return false;
+    }
+    return true;
+}
+template <typename Record>
+bool is_sorted(const SortRecord<Record>* records, size_t count)
+{
+    for (size_t i = 1; i < count; i++)
+    {
+        if (!(records[i - 1] < records[i])) return false;
+    }
+    return true;
 }
@@ -0,0 +1,315 @@
+#include "config.h"
+#include "record.h"
+#include "util.h"
+#include "memory.h"
+#include "sort/sort.h"
+#include "../settings.h"
+
+#include <fstream>
+#include <iostream>
+#include <cstring>
+#include <stdexcept>
+#include <omp.h>
+
+static Config config;
+
+const Config& get_config()
+{
+    return config;
+}
+
+static size_t read_meminfo_total()
+{
+    std::ifstream meminfo("/proc/meminfo");
+    std::string key;
+    size_t value;
+    std::string unit;
+    while (meminfo >> key >> value >> unit)
+    {
+        if (key == "MemTotal:")
+        {
+            return value * 1024;
+        }
+    }
+    return SIZE_MAX;
+}
+
+// cgroup v2 limit of the cgroup of this process and all of its ancestors
+static size_t read_cgroup_limit()
+{
+    std::ifstream cgroups("/proc/self/cgroup");
+    std::string line;
+    std::string path;
+    while (std::getline(cgroups, line))
+    {
+        if (line.compare(0, 3, "0::") == 0)
+        {
+            path = line.substr(3);
+        }
+    }
+    if (path.empty()) return SIZE_MAX;
+
+    size_t limit = SIZE_MAX;
+    for (const std::string root: { "/sys/fs/cgroup", "/sys/fs/cgroup/unified" })
+    {
+        std::string current = path;
+        while (true)
+        {
+            std::ifstream file(root + current + "/memory.max");
+            std::string value;
+            if (file >> value && value != "max")
+            {
+                limit = std::min(limit, static_cast<size_t>(std::stoull(value)));
+            }
+            if (current.empty() || current == "/") break;
+            current = current.substr(0, current.rfind('/'));
+        }
+    }
+    return limit;
+}
+
+size_t detect_memory_limit()
+{
+    return std::min(read_meminfo_total(), read_cgroup_limit());
+}
+
+// parses sizes like 512M, 24G or 1000000
+static size_t parse_size(const std::string& value)
+{
+    size_t end = 0;
+    double number = -1;
+    try
+    {
+        number = std::stod(value, &end);
+    }
+    catch (const std::logic_error&) // std::invalid_argument or std::out_of_range
+    {
+    }
+    std::string suffix = value.substr(end);
+    size_t unit = 0;
+    if (suffix.empty()) unit = 1;
+    else if (suffix == "K" || suffix == "k") unit = 1024;
+    else if (suffix == "M" || suffix == "m") unit = 1024 * 1024;
+    else if (suffix == "G" || suffix == "g") unit = GIB(1);
+    // also rejects NaN
+    if (!unit || !(number >= 0 && number * unit < static_cast<double>(SIZE_MAX)))
+    {
+        std::cerr << "Invalid size: " << value << std::endl;
+        std::exit(1);
+    }
+    return static_cast<size_t>(number * unit);
+}
+
+static size_t clamp(size_t value, size_t low, size_t high)
+{
+    return std::max(low, std::min(value, high));
+}
+
+// shrinks the estimated count until the memory used by that many records fits (the estimates ignore the rounding of
+// the arena)
+template <typename Used>
+static size_t fit_count(size_t estimate, size_t memory, Used used)
+{
+    size_t count = std::max(static_cast<size_t>(1), estimate);
+    while (count > 1 && used(count) > memory)
+    {
+        count -= std::max(static_cast<size_t>(1), count / 64);
+    }
+    return count;
+}
+
+// every buffer is derived from the buffer memory, so that the buffers which are alive at the same time fit into it
+// together with their rounding by the arena (see memory.h)
+static void derive_sizes(Config& config)
+{
+    size_t memory = config.bufferMemoryLimit;
+    size_t record = config.recordSize;
+    size_t sortRecord = sort_record_size(config.keySize);
+
+    config.writeBufferCount = clamp(memory / (256 * record), MERGE_MIN_READ_COUNT, WRITE_BUFFER_MAX_COUNT);
+    // compressed runs are encoded into two buffers of writeBufferCount records (at most one extra byte per record)
+    size_t runWriteMemory = config.runCompression ? 2 * arena_footprint(config.writeBufferCount * (record + 1)) : 0;
+
+    // run generation keeps three chunks (reading, sorting and writing) and the sort keys of one chunk
+    config.externalPartialCount = fit_count(memory / (3 * record + sortRecord), memory, [&](size_t count) {
+        return 3 * arena_footprint(count * record) + arena_footprint(count * sortRecord) + runWriteMemory;
+    });
+    config.externalInmemoryCount = config.externalPartialCount;
+
+    // the in-memory part stays alive during the merge, the rest is split into runs and ranges by merge_fan_in
+    config.mergeMemoryLimit = memory - arena_footprint(config.externalInmemoryCount * record);
+    config.mergeReadCount = clamp(config.mergeMemoryLimit / (MERGE_TARGET_FAN_IN * 3 * record),
+                                  MERGE_MIN_READ_COUNT, MERGE_MAX_READ_COUNT);
+    config.mergeInitialReadCount = config.mergeReadCount * 8 / 5;
+    config.mergeWriteBufferCount = config.mergeReadCount * 4 / 5;
+
+    // replacement selection keeps its memory, a staging block with its sort keys and the double-buffered run output
+    size_t runOutputMemory = 2 * arena_footprint(config.mergeWriteBufferCount * record +
+                                                 (config.directIO ? DIRECT_IO_ALIGNMENT : 0));
+    size_t perRecord = record + (record + sortRecord) / REPLACEMENT_SELECTION_BLOCKS;
+    config.replacementMemoryCount = fit_count((memory - runOutputMemory) / perRecord, memory, [&](size_t count) {
+        size_t block = count / REPLACEMENT_SELECTION_BLOCKS;
+        return arena_footprint(count * record) + arena_footprint(block * record) +
+               arena_footprint(block * sortRecord) + runOutputMemory;
+    });
+}
+
+#define CHECK_SORT_RECORD_SIZE(SIZE, OFFSET, KEY)\
+static_assert(sizeof(SortRecord<FixedRecord<SIZE, OFFSET, KEY>>) == sort_record_size(KEY), "SortRecord size");
+FOR_EACH_RECORD_LAYOUT(CHECK_SORT_RECORD_SIZE)
+#undef CHECK_SORT_RECORD_SIZE
+
+static bool is_layout_compiled(const Config& config)
+{
+#define MATCH_LAYOUT(SIZE, OFFSET, KEY)\
+    if (config.recordSize == SIZE && config.keyOffset == OFFSET && config.keySize == KEY) return true;
+    FOR_EACH_RECORD_LAYOUT(MATCH_LAYOUT)
+#undef MATCH_LAYOUT
+    return false;
+}
+
+static void usage(const char* program)
+{
+    std::cerr << "USAGE: " << program << " [options] [in-file] [outfile]" << std::endl;
+    std::cerr << "  --memory=SIZE           memory budget, e.g. 24G (SORT_MEMORY), detected by default" << std::endl;
+    std::cerr << "  --tmp-dir=PATH          directory for intermediate runs (SORT_TMP_DIR)" << std::endl;
+    std::cerr << "  --io=uring|sync         IO worker backend (SORT_IO_BACKEND)" << std::endl;
+    std::cerr << "  --run-generation=chunks|replacement" << std::endl;
+    std::cerr << "                          external sort run generation (SORT_RUN_GENERATION)" << std::endl;
+    std::cerr << "  --run-compression=none|prefix" << std::endl;
+    std::cerr << "                          key prefix compression of external sort runs (SORT_RUN_COMPRESSION)"
+              << std::endl;
+    std::cerr << "  --direct-io=on|off      O_DIRECT for runs and merges of external sort (SORT_DIRECT_IO)"
+              << std::endl;
+    std::cerr << "  --permutation=direct|blocked" << std::endl;
+    std::cerr << "                          gather of the sorted records of in-memory sort (SORT_PERMUTATION)"
+              << std::endl;
+    std::cerr << "  --numa=auto|off         NUMA thread binding and buffer placement (SORT_NUMA)" << std::endl;
+    std::cerr << "  --format=fixed|lines|length-prefixed" << std::endl;
+    std::cerr << "                          record format, fixed by default (SORT_RECORD_FORMAT)" << std::endl;
+    std::cerr << "  --record-size=BYTES     record size, 100 by default (SORT_RECORD_SIZE)" << std::endl;
+    std::cerr << "  --key-offset=BYTES      offset of the key in the record, 0 by default (SORT_KEY_OFFSET)" << std::endl;
+    std::cerr << "  --key-size=BYTES        key size, 10 by default (SORT_KEY_SIZE)" << std::endl;
+}
+
+std::vector<std::string> init_config(int argc, char** argv)
+{
+    // environment variables are applied first, command line flags override them
+    std::vector<std::pair<std::string, std::string>> options;
+    const std::pair<const char*, const char*> environment[] = {
+            { "SORT_MEMORY", "memory" },
+            { "SORT_TMP_DIR", "tmp-dir" },
+            { "SORT_IO_BACKEND", "io" },
+            { "SORT_RUN_GENERATION", "run-generation" },
+            { "SORT_RUN_COMPRESSION", "run-compression" },
+            { "SORT_DIRECT_IO", "direct-io" },
+            { "SORT_PERMUTATION", "permutation" },
+            { "SORT_NUMA", "numa" },
+            { "SORT_RECORD_FORMAT", "format" },
+            { "SORT_RECORD_SIZE", "record-size" },
+            { "SORT_KEY_OFFSET", "key-offset" },
+            { "SORT_KEY_SIZE", "key-size" }
+    };
+    for (auto& variable: environment)
+    {
+        const char* value = std::getenv(variable.first);
+        if (value && *value)
+        {
+            options.emplace_back(variable.second, value);
+        }
+    }
+
+    std::vector<std::string> positional;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg.compare(0, 2, "--") != 0)
+        {
+            positional.push_back(arg);
+            continue;
+        }
+
+        auto separator = arg.find('=');
+        if (separator == std::string::npos)
+        {
+            usage(argv[0]);
+            std::exit(1);
+        }
+        options.emplace_back(arg.substr(2, separator - 2), arg.substr(separator + 1));
+    }
+
+    config.memoryLimit = static_cast<size_t>(detect_memory_limit() * MEMORY_BUDGET_FRACTION);
+    config.writeLocation = DEFAULT_WRITE_LOCATION;
+
+    for (auto& option: options)
+    {
+        auto& key = option.first;
+        auto& value = option.second;
+        if (key == "memory") config.memoryLimit = parse_size(value);
+        else if (key == "tmp-dir") config.writeLocation = value;
+        else if (key == "io" && (value == "uring" || value == "sync")) config.ioUring = value == "uring";
+        else if (key == "run-generation" && (value == "chunks" || value == "replacement"))
+        {
+            config.replacementSelection = value == "replacement";
+        }
+        else if (key == "run-compression" && (value == "none" || value == "prefix"))
+        {
+            config.runCompression = value == "prefix";
+        }
+        else if (key == "direct-io" && (value == "on" || value == "off")) config.directIO = value == "on";
+        else if (key == "permutation" && (value == "direct" || value == "blocked"))
+        {
+            config.blockedPermutation = value == "blocked";
+        }
+        else if (key == "numa" && (value == "auto" || value == "off")) config.numa = value == "auto";
+        else if (key == "format" && value == "fixed") config.format = RecordFormat::Fixed;
+        else if (key == "format" && value == "lines") config.format = RecordFormat::Lines;
+        else if (key == "format" && value == "length-prefixed") config.format = RecordFormat::LengthPrefixed;
+        else if (key == "record-size") config.recordSize = parse_size(value);
+        else if (key == "key-offset") config.keyOffset = parse_size(value);
+        else if (key == "key-size") config.keySize = parse_size(value);
+        else
+        {
+            std::cerr << "Invalid option: " << key << "=" << value << std::endl;
+            usage(argv[0]);
+            std::exit(1);
+        }
+    }
+
+    if (positional.size() != 2)
+    {
+        usage(argv[0]);
+        std::exit(1);
+    }
+    if (config.format == RecordFormat::Fixed && !is_layout_compiled(config))
+    {
+        std::cerr << "Unsupported record layout (record size " << config.recordSize << ", key offset "
+                  << config.keyOffset << ", key size " << config.keySize << "), supported layouts:";
+#define PRINT_LAYOUT(SIZE, OFFSET, KEY) std::cerr << " " << SIZE << "/" << OFFSET << "/" << KEY;
+        FOR_EACH_RECORD_LAYOUT(PRINT_LAYOUT)
+#undef PRINT_LAYOUT
+        std::cerr << std::endl;
+        std::exit(1);
+    }
+
+    // the run generation and the merge need at least a few buffers of MERGE_MIN_READ_COUNT records (or of
+    // VARLEN_MIN_RUN_BUFFER bytes for variable-length records) besides the memory of the process itself
+    size_t reserve = MEMORY_RESERVE + static_cast<size_t>(omp_get_max_threads()) * MEMORY_RESERVE_PER_THREAD;
+    size_t buffer = config.format == RecordFormat::Fixed ? MERGE_MIN_READ_COUNT * config.recordSize
+                                                         : VARLEN_MIN_RUN_BUFFER;
+    size_t minimumMemory = reserve + MEMORY_MIN_MERGE_BUFFERS * buffer;
+    if (config.memoryLimit < minimumMemory)
+    {
+        std::cerr << "Memory budget too small: " << config.memoryLimit << " bytes, at least " << minimumMemory
+                  << " bytes are needed" << std::endl;
+        std::exit(1);
+    }
+
+    config.bufferMemoryLimit = config.memoryLimit - reserve;
+    derive_sizes(config);
+
+    std::cerr << "Memory budget: " << config.memoryLimit / (1024 * 1024) << " MiB (buffers "
+              << config.bufferMemoryLimit / (1024 * 1024) << " MiB), run size: "
+              << config.externalPartialCount << ", merge read: " << config.mergeReadCount << std::endl;
+    return positional;
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <cstddef>
+
+// layout of the input records
+enum class RecordFormat {
+    Fixed,          // records of recordSize bytes
+    Lines,          // newline-delimited records
+    LengthPrefixed  // records prefixed by their length (32-bit little-endian)
+};
+
+// runtime configuration, derived from the memory budget of the machine (or container)
+// every value can be influenced by command line flags or environment variables (see init_config)
+struct Config {
+    size_t memoryLimit = 0;             // memory budget in bytes
+    size_t bufferMemoryLimit = 0;       // memory budget without the reserve of the process itself (in bytes)
+    std::string writeLocation;          // directory for intermediate run files
+    bool ioUring = true;                // use the io_uring IO worker
+    bool replacementSelection = false;  // use replacement selection run generation in external sort
+    bool runCompression = false;        // write the runs of external sort in the compressed block format
+    bool directIO = false;              // O_DIRECT for the uncompressed runs and the merges of external sort
+    bool numa = true;                   // bind threads and place buffers on NUMA nodes (if there are multiple)
+    bool blockedPermutation = false;    // apply the sorted order in cache- and TLB-sized blocks (in-memory sort)
+
+    RecordFormat format = RecordFormat::Fixed;
+    size_t recordSize = 100;            // record layout, it has to be one of FOR_EACH_RECORD_LAYOUT
+    size_t keyOffset = 0;
+    size_t keySize = 10;
+
+    size_t writeBufferCount = 0;        // number of records to buffer before writing to the output
+
+    size_t externalPartialCount = 0;    // number of records of a single run in external sort
+    size_t externalInmemoryCount = 0;   // number of records kept in memory at the end of external sort
+    size_t replacementMemoryCount = 0;  // number of records of the replacement selection memory
+
+    size_t mergeMemoryLimit = 0;        // memory available for merge buffers (in bytes)
+    size_t mergeReadCount = 0;          // number of records read when a merge buffer is refilled
+    size_t mergeInitialReadCount = 0;   // number of records prefetched for every run before the merge
+    size_t mergeWriteBufferCount = 0;   // size of the merge output buffer
+
+    size_t mergeReadBufferCount() const
+    {
+        return std::max(this->mergeInitialReadCount, this->mergeReadCount);
+    }
+};
+
+const Config& get_config();
+
+// memory limit of this process in bytes (minimum of the physical memory and the cgroup v2 limit)
+size_t detect_memory_limit();
+
+// parses --key=value flags (and SORT_* environment variables) and derives all buffer sizes
+// returns the remaining positional arguments
+std::vector<std::string> init_config(int argc, char** argv);
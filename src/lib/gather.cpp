@@ -0,0 +1,515 @@
+#include "gather.h"
+#include "../settings.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <vector>
+#include <immintrin.h>
+#include <omp.h>
+
+namespace {
+    constexpr size_t LINE = 64;
+
+    enum GatherKind {
+        Plain,
+        StreamAvx2,
+        StreamAvx512,
+        KIND_COUNT
+    };
+    const char* KIND_NAMES[KIND_COUNT] = { "plain", "avx2-stream", "avx512-stream" };
+
+    inline size_t index_of(size_t index)
+    {
+        return index;
+    }
+    template <typename Record>
+    inline size_t index_of(const SortRecord<Record>& item)
+    {
+        return item.index;
+    }
+
+    template <typename Record>
+    inline void prefetch_record(const Record* record)
+    {
+        auto* bytes = reinterpret_cast<const char*>(record);
+        for (size_t offset = 0; offset < sizeof(Record); offset += LINE)
+        {
+            __builtin_prefetch(bytes + offset);
+        }
+        // records are not aligned to cache lines, the end may be in one more line
+        __builtin_prefetch(bytes + sizeof(Record) - 1);
+    }
+
+    template <typename Record, typename Index>
+    void gather_plain(Record* __restrict__ target, const Record* __restrict__ records,
+                      const Index* __restrict__ indices, size_t count)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            if (i + GATHER_PREFETCH_DISTANCE < count)
+            {
+                prefetch_record(records + index_of(indices[i + GATHER_PREFETCH_DISTANCE]));
+            }
+            target[i] = records[index_of(indices[i])];
+        }
+    }
+
+    __attribute__((target("avx2")))
+    inline void stream_line_avx2(char* target, const char* source)
+    {
+        auto* from = reinterpret_cast<const __m256i*>(source);
+        auto* to = reinterpret_cast<__m256i*>(target);
+        _mm256_stream_si256(to, _mm256_load_si256(from));
+        _mm256_stream_si256(to + 1, _mm256_load_si256(from + 1));
+    }
+
+    __attribute__((target("avx512f")))
+    inline void stream_line_avx512(char* target, const char* source)
+    {
+        _mm512_stream_si512(reinterpret_cast<__m512i*>(target), _mm512_load_si512(source));
+    }
+
+    // writes staging[from, to) to line + from (line is aligned to a cache line), whole lines are streamed
+    template <void (*StreamLine)(char*, const char*)>
+    __attribute__((always_inline))
+    inline void flush_staging(char* line, const char* staging, size_t from, size_t to)
+    {
+        size_t first = std::min(to, (from + LINE - 1) / LINE * LINE);
+        size_t last = std::max(first, to / LINE * LINE);
+        std::memcpy(line + from, staging + from, first - from);
+        for (size_t k = first; k < last; k += LINE)
+        {
+            StreamLine(line + k, staging + k);
+        }
+        std::memcpy(line + last, staging + last, to - last);
+    }
+
+    // the records are collected in a staging buffer with the same alignment as the target, so that the target
+    // can be written in whole cache lines, only the partial lines at both ends use regular stores
+    template <typename Record, typename Index, void (*StreamLine)(char*, const char*)>
+    __attribute__((always_inline))
+    inline void gather_staged(Record* __restrict__ target, const Record* __restrict__ records,
+                              const Index* __restrict__ indices, size_t count)
+    {
+        alignas(LINE) char staging[GATHER_STAGING_SIZE + sizeof(Record)];
+        auto* output = reinterpret_cast<char*>(target);
+        // staging[k] belongs to line + k, the first skip bytes of the first line are not part of the target
+        char* line = output - reinterpret_cast<uintptr_t>(output) % LINE;
+        size_t skip = static_cast<size_t>(output - line);
+        size_t used = skip;
+
+        for (size_t i = 0; i < count; i++)
+        {
+            if (i + GATHER_PREFETCH_DISTANCE < count)
+            {
+                prefetch_record(records + index_of(indices[i + GATHER_PREFETCH_DISTANCE]));
+            }
+            std::memcpy(staging + used, records + index_of(indices[i]), sizeof(Record));
+            used += sizeof(Record);
+            if (used >= GATHER_STAGING_SIZE)
+            {
+                size_t full = used / LINE * LINE;
+                flush_staging<StreamLine>(line, staging, skip, full);
+                std::memcpy(staging, staging + full, used - full);
+                line += full;
+                used -= full;
+                skip = 0;
+            }
+        }
+        flush_staging<StreamLine>(line, staging, skip, used);
+        // non-temporal stores are weakly ordered
+        _mm_sfence();
+    }
+
+    template <typename Record, typename Index>
+    __attribute__((target("avx2")))
+    void gather_stream_avx2(Record* target, const Record* records, const Index* indices, size_t count)
+    {
+        gather_staged<Record, Index, stream_line_avx2>(target, records, indices, count);
+    }
+
+    template <typename Record, typename Index>
+    __attribute__((target("avx512f")))
+    void gather_stream_avx512(Record* target, const Record* records, const Index* indices, size_t count)
+    {
+        gather_staged<Record, Index, stream_line_avx512>(target, records, indices, count);
+    }
+
+    template <typename Record, typename Index>
+    using GatherKernel = void (*)(Record*, const Record*, const Index*, size_t);
+
+    template <typename Record, typename Index>
+    GatherKernel<Record, Index> gather_kernel(int kind)
+    {
+        switch (kind)
+        {
+            case StreamAvx2: return gather_stream_avx2<Record, Index>;
+            case StreamAvx512: return gather_stream_avx512<Record, Index>;
+            default: return gather_plain<Record, Index>;
+        }
+    }
+
+    // the first blocks of the gather are distributed over the supported kernels (in parallel gathers by all
+    // threads, so the kernels are measured under the real memory load), the block that finishes the
+    // measurement selects the kernel with the lowest time per record
+    class GatherSelection {
+    public:
+        GatherSelection()
+        {
+            __builtin_cpu_init();
+            this->kinds.push_back(Plain);
+            if (__builtin_cpu_supports("avx2")) this->kinds.push_back(StreamAvx2);
+            if (__builtin_cpu_supports("avx512f")) this->kinds.push_back(StreamAvx512);
+            this->trialCount = GATHER_CALIBRATION_BLOCKS * this->kinds.size();
+        }
+
+        // kernel for the next block, timed is set if the block is a part of the measurement
+        int next(bool& timed)
+        {
+            timed = false;
+            int kind = this->selected.load(std::memory_order_relaxed);
+            if (kind >= 0) return kind;
+
+            size_t trial = this->trials++;
+            if (trial >= this->trialCount) return this->kinds.back();
+            timed = true;
+            return this->kinds[trial % this->kinds.size()];
+        }
+
+        void report(int kind, size_t records, uint64_t nanoseconds)
+        {
+            this->nanoseconds[kind] += nanoseconds;
+            this->records[kind] += records;
+            if (++this->finished == this->trialCount)
+            {
+                this->select();
+            }
+        }
+
+    private:
+        void select()
+        {
+            int best = this->kinds[0];
+            std::cerr << "Gather kernels:";
+            for (int kind: this->kinds)
+            {
+                double perRecord = this->nanoseconds[kind] / std::max(1.0, static_cast<double>(this->records[kind]));
+                double bestPerRecord = this->nanoseconds[best] /
+                                       std::max(1.0, static_cast<double>(this->records[best]));
+                if (perRecord < bestPerRecord) best = kind;
+                std::cerr << " " << KIND_NAMES[kind] << " " << perRecord << " ns";
+            }
+            std::cerr << " per record, using " << KIND_NAMES[best] << std::endl;
+            this->selected = best;
+        }
+
+        std::vector<int> kinds;     // supported kernels
+        size_t trialCount = 0;
+        std::atomic<int> selected{-1};
+        std::atomic<size_t> trials{0};
+        std::atomic<size_t> finished{0};
+        std::atomic<uint64_t> nanoseconds[KIND_COUNT] = {};
+        std::atomic<uint64_t> records[KIND_COUNT] = {};
+    };
+
+    template <typename Record>
+    GatherSelection& gather_selection()
+    {
+        static GatherSelection selection;
+        return selection;
+    }
+}
+
+template <typename Record, typename Index>
+void gather_records(Record* target, const Record* records, const Index* indices, size_t count)
+{
+    auto& selection = gather_selection<Record>();
+    for (size_t start = 0; start < count; start += GATHER_BLOCK_RECORDS)
+    {
+        size_t blockCount = std::min(static_cast<size_t>(GATHER_BLOCK_RECORDS), count - start);
+        bool timed;
+        int kind = selection.next(timed);
+        auto begin = std::chrono::steady_clock::now();
+        gather_kernel<Record, Index>(kind)(target + start, records, indices + start, blockCount);
+        if (timed)
+        {
+            auto elapsed = std::chrono::steady_clock::now() - begin;
+            selection.report(kind, blockCount,
+                             std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+        }
+    }
+}
+
+template <typename Record, typename Index>
+void gather_records_parallel(Record* target, const Record* records, const Index* indices, size_t count,
+                             size_t threads)
+{
+#pragma omp parallel num_threads(std::max(static_cast<size_t>(1), threads))
+    {
+        auto thread = static_cast<size_t>(omp_get_thread_num());
+        auto team = static_cast<size_t>(omp_get_num_threads());
+        size_t start = count * thread / team;
+        size_t end = count * (thread + 1) / team;
+        gather_records(target + start, records, indices + start, end - start);
+    }
+}
+
+template <typename Record, typename Index>
+void gather_records_blocked(Record* target, const Record* records, const Index* indices, size_t count,
+                            size_t sourceCount)
+{
+    struct Entry {
+        size_t source;
+        uint32_t position;  // in the output block
+    };
+    const size_t blockCount = std::max(static_cast<size_t>(1),
+                                       static_cast<size_t>(PERMUTE_BLOCK_SIZE / sizeof(Record)));
+    const size_t windowCount = std::max(static_cast<size_t>(1),
+                                        static_cast<size_t>(PERMUTE_WINDOW_SIZE / sizeof(Record)));
+    const size_t windows = sourceCount / windowCount + 1;
+
+    // reused by all blocks of a thread (the merge calls this for every output block)
+    static thread_local std::vector<Entry> entries;
+    static thread_local std::vector<uint32_t> starts;
+    entries.resize(std::max(entries.size(), std::min(count, blockCount)));
+    starts.resize(windows + 1);
+
+    for (size_t block = 0; block < count; block += blockCount)
+    {
+        size_t entryCount = std::min(blockCount, count - block);
+        auto* blockIndices = indices + block;
+
+        // the indices of the output block are bucketed by their source window
+        std::fill(starts.begin(), starts.end(), 0);
+        for (size_t i = 0; i < entryCount; i++)
+        {
+            starts[index_of(blockIndices[i]) / windowCount + 1]++;
+        }
+        for (size_t w = 0; w < windows; w++)
+        {
+            starts[w + 1] += starts[w];
+        }
+        for (size_t i = 0; i < entryCount; i++)
+        {
+            size_t source = index_of(blockIndices[i]);
+            entries[starts[source / windowCount]++] = Entry{ source, static_cast<uint32_t>(i) };
+        }
+
+        // the records are read window by window
+        auto* __restrict__ output = target + block;
+        for (size_t i = 0; i < entryCount; i++)
+        {
+            if (i + GATHER_PREFETCH_DISTANCE < entryCount)
+            {
+                prefetch_record(records + entries[i + GATHER_PREFETCH_DISTANCE].source);
+            }
+            output[entries[i].position] = records[entries[i].source];
+        }
+    }
+}
+
+template <typename Record, typename Index>
+void gather_records_blocked_parallel(Record* target, const Record* records, const Index* indices, size_t count,
+                                     size_t sourceCount, size_t threads)
+{
+#pragma omp parallel num_threads(std::max(static_cast<size_t>(1), threads))
+    {
+        auto thread = static_cast<size_t>(omp_get_thread_num());
+        auto team = static_cast<size_t>(omp_get_num_threads());
+        size_t start = count * thread / team;
+        size_t end = count * (thread + 1) / team;
+        gather_records_blocked(target + start, records, indices + start, end - start, sourceCount);
+    }
+}
+
+template <typename Record>
+void permute_records_inplace(Record* records, const SortRecord<Record>* sorted, size_t count, size_t threads)
+{
+    // a walk starts at its first position and pulls the records of the following positions of the cycle into the
+    // previous positions, it ends at waitPosition that needs the original record of waitStart
+    struct Walk {
+        size_t start;
+        size_t waitPosition;
+        size_t waitStart;
+        bool waiting;   // waitPosition has not received its record yet
+        bool consumed;  // stash was written to the end of another walk
+        Record stash;   // original record of start
+    };
+
+    // a position is claimed before its original record is read, only the claiming thread overwrites it
+    std::vector<std::atomic<uint64_t>> claimed((count + 63) / 64);
+    auto claim = [&claimed](size_t position) {
+        uint64_t bit = 1ull << (position % 64);
+        return !(claimed[position / 64].fetch_or(bit, std::memory_order_relaxed) & bit);
+    };
+
+    // the next position of a walk is loaded and prefetched one round before it is moved, every thread advances
+    // PERMUTE_INPLACE_WALKS walks in turns, so that their memory accesses overlap
+    struct Active {
+        Walk walk;
+        size_t position;
+        size_t next;
+        bool running;
+    };
+    auto prefetch_next = [&](Active& active) {
+        active.next = sorted[active.position].index;
+        prefetch_record(records + active.next);
+        __builtin_prefetch(sorted + active.next);
+        __builtin_prefetch(&claimed[active.next / 64]);
+    };
+
+    // the walks run in rounds: once PERMUTE_INPLACE_PENDING_WALKS walks have stopped at the start of another walk,
+    // no new walks are started and after the running ones have stopped as well, the end of every stopped walk
+    // receives the stash of the walk that it waits for, only the stashes that are still awaited are kept
+    threads = std::max(static_cast<size_t>(1), threads);
+    std::vector<std::vector<Walk>> walks(threads);
+    std::vector<Walk*> pending;
+    std::atomic<size_t> stopped{ 0 };
+    std::atomic<bool> resolve{ false };
+    std::atomic<size_t> unfinished{ 0 };
+#pragma omp parallel num_threads(threads)
+    {
+        auto thread = static_cast<size_t>(omp_get_thread_num());
+        auto team = static_cast<size_t>(omp_get_num_threads());
+        auto& local = walks[thread];
+        size_t cursor = count * thread / team;
+        size_t end = count * (thread + 1) / team;
+
+        // starts a walk at the next unclaimed position of the thread's part
+        auto start_walk = [&](Active& active) {
+            if (resolve.load(std::memory_order_relaxed)) return false;
+            for (; cursor < end; cursor++)
+            {
+                size_t i = cursor;
+                if (claimed[i / 64].load(std::memory_order_relaxed) & (1ull << (i % 64))) continue;
+                if (!claim(i) || sorted[i].index == i) continue;
+
+                active.walk.start = i;
+                active.walk.stash = records[i];
+                active.position = i;
+                prefetch_next(active);
+                cursor++;
+                return true;
+            }
+            return false;
+        };
+
+        Active actives[PERMUTE_INPLACE_WALKS];
+        while (true)
+        {
+            size_t running = 0;
+            for (auto& active: actives)
+            {
+                active.running = start_walk(active);
+                running += active.running;
+            }
+            while (running)
+            {
+                for (auto& active: actives)
+                {
+                    if (!active.running) continue;
+                    if (!claim(active.next))
+                    {
+                        auto* other = std::find_if(std::begin(actives), std::end(actives), [&](const Active& o) {
+                            return o.running && o.walk.start == active.next;
+                        });
+                        if (other == &active)
+                        {
+                            // the walk closed its own cycle
+                            records[active.position] = active.walk.stash;
+                        }
+                        else if (other != std::end(actives))
+                        {
+                            // another walk of the thread started at the next position, it continues this walk
+                            records[active.position] = other->walk.stash;
+                            other->walk.start = active.walk.start;
+                            other->walk.stash = active.walk.stash;
+                        }
+                        else
+                        {
+                            active.walk.waitPosition = active.position;
+                            active.walk.waitStart = active.next;
+                            active.walk.waiting = true;
+                            active.walk.consumed = false;
+                            local.push_back(active.walk);
+                            if (stopped.fetch_add(1, std::memory_order_relaxed) + 1 >= PERMUTE_INPLACE_PENDING_WALKS)
+                            {
+                                resolve.store(true, std::memory_order_relaxed);
+                            }
+                        }
+                        active.running = start_walk(active);
+                        running -= !active.running;
+                        continue;
+                    }
+                    records[active.position] = records[active.next];
+                    active.position = active.next;
+                    prefetch_next(active);
+                }
+            }
+            if (cursor < end) unfinished.fetch_add(1, std::memory_order_relaxed);
+#pragma omp barrier
+
+            // every walk that is waited for has stopped (a walk that closed its own cycle is not waited for)
+#pragma omp single
+            {
+                pending.clear();
+                for (auto& walkList: walks)
+                {
+                    for (auto& walk: walkList)
+                    {
+                        pending.push_back(&walk);
+                    }
+                }
+                std::sort(pending.begin(), pending.end(), [](const Walk* lhs, const Walk* rhs) {
+                    return lhs->start < rhs->start;
+                });
+            }
+#pragma omp for
+            for (size_t i = 0; i < pending.size(); i++)
+            {
+                auto* walk = pending[i];
+                if (!walk->waiting) continue;
+                auto source = std::lower_bound(pending.begin(), pending.end(), walk->waitStart,
+                                               [](const Walk* other, size_t start) {
+                    return other->start < start;
+                });
+                records[walk->waitPosition] = (*source)->stash;
+                (*source)->consumed = true;
+                walk->waiting = false;
+            }
+            local.erase(std::remove_if(local.begin(), local.end(), [](const Walk& walk) {
+                return walk.consumed;
+            }), local.end());
+
+            bool done = !unfinished.load(std::memory_order_relaxed);
+#pragma omp barrier
+#pragma omp single
+            {
+                stopped.store(0, std::memory_order_relaxed);
+                resolve.store(false, std::memory_order_relaxed);
+                unfinished.store(0, std::memory_order_relaxed);
+            }
+            if (done) break;
+        }
+    }
+}
+
+#define INSTANTIATE(SIZE, OFFSET, KEY)\
+template void gather_records(FixedRecord<SIZE, OFFSET, KEY>*, const FixedRecord<SIZE, OFFSET, KEY>*,\
+        const SortRecord<FixedRecord<SIZE, OFFSET, KEY>>*, size_t);\
+template void gather_records(FixedRecord<SIZE, OFFSET, KEY>*, const FixedRecord<SIZE, OFFSET, KEY>*,\
+        const size_t*, size_t);\
+template void gather_records_parallel(FixedRecord<SIZE, OFFSET, KEY>*, const FixedRecord<SIZE, OFFSET, KEY>*,\
+        const SortRecord<FixedRecord<SIZE, OFFSET, KEY>>*, size_t, size_t);\
+template void gather_records_parallel(FixedRecord<SIZE, OFFSET, KEY>*, const FixedRecord<SIZE, OFFSET, KEY>*,\
+        const size_t*, size_t, size_t);\
+template void gather_records_blocked(FixedRecord<SIZE, OFFSET, KEY>*, const FixedRecord<SIZE, OFFSET, KEY>*,\
+        const size_t*, size_t, size_t);\
+template void gather_records_blocked_parallel(FixedRecord<SIZE, OFFSET, KEY>*, const FixedRecord<SIZE, OFFSET, KEY>*,\
+        const SortRecord<FixedRecord<SIZE, OFFSET, KEY>>*, size_t, size_t, size_t);\
+template void permute_records_inplace(FixedRecord<SIZE, OFFSET, KEY>*,\
+        const SortRecord<FixedRecord<SIZE, OFFSET, KEY>>*, size_t, size_t);
+FOR_EACH_RECORD_LAYOUT(INSTANTIATE)
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstddef>
+
+#include "record.h"
+
+// Gather of records in sorted order (target[i] = records[index of i]). The random reads are memory latency bound,
+// so the kernels prefetch the records a few iterations ahead. Besides a plain copy there are AVX2 and AVX-512
+// kernels that collect the records in a small staging buffer and write whole cache lines with non-temporal stores,
+// so that the output does not evict the input from the caches.
+// The kernels are selected at runtime: every kernel that the CPU supports is timed on the first blocks of the real
+// gather and the fastest one is used for the rest of the process (separately for every record layout).
+// The index of a record is either the index of a SortRecord or a plain size_t.
+template <typename Record, typename Index>
+void gather_records(Record* target, const Record* records, const Index* indices, size_t count);
+
+// gather_records split over the given number of threads (one contiguous part per thread)
+template <typename Record, typename Index>
+void gather_records_parallel(Record* target, const Record* records, const Index* indices, size_t count,
+                             size_t threads);
+
+// Cache- and TLB-blocked gather for sources that are much larger than the reach of the TLB: the output is
+// processed in blocks of PERMUTE_BLOCK_SIZE bytes, the indices of a block are first bucketed by source windows of
+// PERMUTE_WINDOW_SIZE bytes and the records are then copied window by window, so that the reads stay within the
+// pages of one window at a time and the writes within the cache-resident output block.
+// sourceCount is the number of records in records.
+template <typename Record, typename Index>
+void gather_records_blocked(Record* target, const Record* records, const Index* indices, size_t count,
+                            size_t sourceCount);
+
+template <typename Record, typename Index>
+void gather_records_blocked_parallel(Record* target, const Record* records, const Index* indices, size_t count,
+                                     size_t sourceCount, size_t threads);
+
+// applies the sorted order to records in place (records[i] becomes the record that was at sorted[i].index):
+// the permutation cycles are followed by all threads in parallel, every position is claimed by the thread that
+// moves its record, a walk that reaches a position claimed by another walk ends there and the record of that
+// position is taken from the other walk's stash (its first record) once enough walks have stopped
+template <typename Record>
+void permute_records_inplace(Record* records, const SortRecord<Record>* sorted, size_t count, size_t threads);
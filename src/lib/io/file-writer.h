@@ -2,45 +2,59 @@
 
 #include <fcntl.h>
 #include <cassert>
+#include <cerrno>
 #include <sys/mman.h>
 #include <memory>
 #include <sys/sendfile.h>
 
 #include "../util.h"
-#include "../record.h"
 #include "memory-reader.h"
 
 class FileWriter {
 public:
-    explicit FileWriter(const char* path, bool direct = false)
+    // counts and offsets of all operations are in records of recordSize bytes
+    // with direct, the data, offsets and sizes of all writes have to be aligned to DIRECT_IO_ALIGNMENT, except
+    // for write_unaligned
+    FileWriter(const char* path, size_t recordSize, bool direct = false): recordSize(recordSize)
     {
         uint32_t mode = O_WRONLY | O_CREAT;
         if (direct)
         {
             mode |= O_DIRECT;
+            this->bufferedFile = open(path, O_WRONLY | O_CREAT, 0666);
+            CHECK_NEG_ERROR(this->bufferedFile);
         }
         this->file = open(path, mode, 0666);
+        if (this->file == -1 && direct && errno == EINVAL)
+        {
+            // the file system does not support O_DIRECT (e.g. tmpfs)
+            this->file = open(path, O_WRONLY | O_CREAT, 0666);
+        }
         CHECK_NEG_ERROR(this->file);
     }
     ~FileWriter()
     {
         CHECK_NEG_ERROR(close(this->file));
+        if (this->bufferedFile != -1)
+        {
+            CHECK_NEG_ERROR(close(this->bufferedFile));
+        }
     }
     DISABLE_COPY(FileWriter);
     DISABLE_MOVE(FileWriter);
 
     void preallocate(size_t count)
     {
-        CHECK_NEG_ERROR(ftruncate64(this->file, count * TUPLE_SIZE));
+        CHECK_NEG_ERROR(ftruncate64(this->file, count * this->recordSize));
     }
     void seek(size_t offset)
     {
-        CHECK_NEG_ERROR(lseek64(this->file, offset * TUPLE_SIZE, SEEK_SET));
+        CHECK_NEG_ERROR(lseek64(this->file, offset * this->recordSize, SEEK_SET));
     }
 
-    void write(const Record* data, size_t count)
+    void write(const void* data, size_t count)
     {
-        size_t size = count * TUPLE_SIZE;
+        size_t size = count * this->recordSize;
         size_t total = 0;
         auto input = reinterpret_cast<const char*>(data);
 
@@ -51,10 +65,10 @@ public:
             total += written;
         }
     }
-    void write_at(const Record* data, size_t count, size_t offset)
+    void write_at(const void* data, size_t count, size_t offset)
     {
-        size_t size = count * TUPLE_SIZE;
-        offset *= TUPLE_SIZE;
+        size_t size = count * this->recordSize;
+        offset *= this->recordSize;
         size_t total = 0;
         auto input = reinterpret_cast<const char*>(data);
 
@@ -65,23 +79,44 @@ public:
             total += written;
         }
     }
+    // writes size bytes at a byte offset through the page cache, for the partial blocks at the ends of direct writes
+    void write_unaligned(const void* data, size_t size, size_t offset)
+    {
+        int handle = this->bufferedFile != -1 ? this->bufferedFile : this->file;
+        size_t total = 0;
+        auto input = reinterpret_cast<const char*>(data);
+
+        while (total < size)
+        {
+            ssize_t written = ::pwrite64(handle, input + total, size - total, offset + total);
+            CHECK_NEG_ERROR(written);
+            total += written;
+        }
+    }
     void writeout(size_t count, size_t offset)
     {
-        CHECK_NEG_ERROR(sync_file_range(this->file, offset * TUPLE_SIZE, count * TUPLE_SIZE, SYNC_FILE_RANGE_WRITE));
+        CHECK_NEG_ERROR(sync_file_range(this->file, offset * this->recordSize, count * this->recordSize,
+                                        SYNC_FILE_RANGE_WRITE));
     }
     void discard(size_t count, size_t offset)
     {
-        CHECK_NEG_ERROR(sync_file_range(this->file, offset * TUPLE_SIZE, count * TUPLE_SIZE,
+        CHECK_NEG_ERROR(sync_file_range(this->file, offset * this->recordSize, count * this->recordSize,
                                         SYNC_FILE_RANGE_WAIT_BEFORE |
                                         SYNC_FILE_RANGE_WRITE |
                                         SYNC_FILE_RANGE_WAIT_AFTER));
-        CHECK_NEG_ERROR(posix_fadvise64(this->file, offset * TUPLE_SIZE, count * TUPLE_SIZE, POSIX_FADV_DONTNEED));
+        CHECK_NEG_ERROR(posix_fadvise64(this->file, offset * this->recordSize, count * this->recordSize,
+                                        POSIX_FADV_DONTNEED));
     }
 
-    void write_discard(Record* record, size_t count, ssize_t offset, size_t previousCount, size_t discardWindow)
+    void write_discard(const void* record, size_t count, ssize_t offset, size_t previousCount, size_t discardWindow)
     {
         this->write_at(record, count, offset);
+        this->discard_behind(offset, previousCount, discardWindow);
+    }
 
+    // starts writeout of older data and drops it from the page cache once it was written
+    void discard_behind(ssize_t offset, size_t previousCount, size_t discardWindow)
+    {
         size_t writeoutWindow = discardWindow / 2;
         ssize_t writeoutOffset = offset - writeoutWindow * previousCount;
         if (writeoutOffset >= 0)
@@ -98,9 +133,22 @@ public:
 
     void expect_sequential(size_t count, size_t offset)
     {
-        CHECK_NEG_ERROR(posix_fadvise64(this->file, offset * TUPLE_SIZE, count * TUPLE_SIZE, POSIX_FADV_SEQUENTIAL));
+        CHECK_NEG_ERROR(posix_fadvise64(this->file, offset * this->recordSize, count * this->recordSize,
+                                        POSIX_FADV_SEQUENTIAL));
+    }
+
+    int get_handle() const
+    {
+        return this->file;
+    }
+
+    size_t record_size() const
+    {
+        return this->recordSize;
     }
 
 private:
     int file;
+    int bufferedFile = -1;
+    size_t recordSize;
 };
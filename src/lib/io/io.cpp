@@ -5,6 +5,11 @@
 #include "../sync.h"
 #include "../sort/merge.h"
 #include "../sort/buffer.h"
+#include "../sort/run-format.h"
+#include "../numa.h"
+#include "../memory.h"
+#include "../gather.h"
+#include "../config.h"
 
 #include <vector>
 #include <memory>
@@ -18,21 +23,22 @@
 #include <thread>
 #include <atomic>
 
-void write_buffered(const Record *records, const SortRecord *sorted, size_t count, const std::string& output,
+template <typename Record>
+void write_buffered(const Record *records, const SortRecord<Record> *sorted, size_t count, const std::string& output,
                     size_t buffer_size, size_t threads)
 {
-    FileWriter fileOutput(output.c_str());
+    FileWriter fileOutput(output.c_str(), sizeof(Record));
     fileOutput.preallocate(count);
 
     const size_t outerThreads = 4;
     const size_t innerThreads = threads / outerThreads;
     const auto threadChunk = static_cast<size_t>(std::ceil((double) count / outerThreads));
 
-    FileWriter writer(output.c_str());
+    FileWriter writer(output.c_str(), sizeof(Record));
 
 #pragma omp parallel num_threads(outerThreads)
     {
-        auto buffer = std::unique_ptr<Record[]>(new Record[buffer_size]);
+        HugePageBuffer<Record> buffer(buffer_size);
 
         auto threadId = static_cast<size_t>(omp_get_thread_num());
         size_t start = threadId * threadChunk;
@@ -43,11 +49,7 @@ void write_buffered(const Record *records, const SortRecord *sorted, size_t coun
             size_t left = end - start;
 //            Timer timerCopy;
             size_t to_handle = std::min(left, buffer_size);
-#pragma omp parallel for num_threads(innerThreads)
-            for (size_t i = 0; i < to_handle; i++)
-            {
-                buffer[i] = records[sorted[start + i].index];
-            }
+            gather_records_parallel(buffer.get(), records, sorted + start, to_handle, innerThreads);
 //            timerCopy.print("Write copy");
 
 //            Timer timerIO;
@@ -58,10 +60,51 @@ void write_buffered(const Record *records, const SortRecord *sorted, size_t coun
     }
 }
 
-void write_sequential_io(const Record *records, const SortRecord *sorted, size_t count, const std::string& output,
-                    size_t buffer_size, size_t threads)
+// O_DIRECT variant of write_sequential_io, the run is written front to back in whole blocks and the partial last
+// block through the page cache
+template <typename Record>
+static void write_sequential_direct(const Record* records, const SortRecord<Record>* sorted, size_t count,
+                                    const std::string& output, size_t buffer_size)
+{
+    FileWriter writer(output.c_str(), 1, true);
+    writer.preallocate(count * sizeof(Record));
+
+    SyncQueue<IORequest> ioQueue;
+    SyncQueue<size_t> notifyQueue;
+
+    std::thread ioThread = ioWorker(ioQueue);
+
+    WriteBuffer<Record> outBuffer(buffer_size, true);
+    outBuffer.start_direct(0);
+    notifyQueue.push(0);
+
+    size_t processed = 0;
+    while (processed < count)
+    {
+        auto to_handle = std::min(buffer_size, count - processed);
+        gather_records_parallel(outBuffer.getActiveBuffer(), records, sorted + processed, to_handle, 10);
+        outBuffer.offset = to_handle;
+        processed += to_handle;
+
+        notifyQueue.pop();
+        ioQueue.push(outBuffer.flush_direct(writer, &notifyQueue, processed == count));
+    }
+    notifyQueue.pop();
+    ioQueue.push(IORequest::last());
+    ioThread.join();
+}
+
+template <typename Record>
+void write_sequential_io(const Record *records, const SortRecord<Record> *sorted, size_t count,
+                         const std::string& output, size_t buffer_size, size_t threads)
 {
-    FileWriter writer(output.c_str());
+    if (get_config().directIO)
+    {
+        write_sequential_direct(records, sorted, count, output, buffer_size);
+        return;
+    }
+
+    FileWriter writer(output.c_str(), sizeof(Record));
     writer.preallocate(count);
 
     SyncQueue<IORequest> ioQueue;
@@ -69,7 +112,7 @@ void write_sequential_io(const Record *records, const SortRecord *sorted, size_t
 
     std::thread ioThread = ioWorker(ioQueue);
 
-    WriteBuffer outBuffer(buffer_size);
+    WriteBuffer<Record> outBuffer(buffer_size);
     notifyQueue.push(0);
 
     size_t processed = 0;
@@ -81,11 +124,7 @@ void write_sequential_io(const Record *records, const SortRecord *sorted, size_t
         auto start = count - processed - to_handle;
 
 //        Timer timerCopy;
-#pragma omp parallel for num_threads(10)
-        for (size_t i = 0; i < to_handle; i++)
-        {
-            buffer[i] = records[sorted[start + i].index];
-        }
+        gather_records_parallel(buffer, records, sorted + start, to_handle, 10);
         processed += to_handle;
 //        timerCopy.print("Sequential copy");
 
@@ -100,48 +139,107 @@ void write_sequential_io(const Record *records, const SortRecord *sorted, size_t
     ioThread.join();
 }
 
-void write_mmap(const Record* __restrict__ records, const uint32_t* __restrict__ sorted, ssize_t count,
+template <typename Record>
+std::shared_ptr<RunIndex> write_compressed_run(const Record* records, const SortRecord<Record>* sorted, size_t count,
+                                               const std::string& output, size_t buffer_size, size_t threads)
+{
+    FileWriter writer(output.c_str(), 1);
+    auto index = std::make_shared<RunIndex>(sizeof(Record), Record::KEY_OFFSET, Record::KEY_SIZE, count);
+
+    SyncQueue<IORequest> ioQueue;
+    SyncQueue<size_t> notifyQueue;
+    std::thread ioThread = ioWorker(ioQueue);
+
+    // blocks of a batch are encoded in parallel into fixed slots and compacted before the write
+    const size_t slot = index->max_block_bytes();
+    const size_t batch = std::max(static_cast<size_t>(1), buffer_size / RUN_BLOCK_RECORDS);
+    HugePageBuffer<uint8_t> buffers[2] = { HugePageBuffer<uint8_t>(batch * slot),
+                                           HugePageBuffer<uint8_t>(batch * slot) };
+    size_t active = 0;
+    std::vector<size_t> sizes(batch);
+    notifyQueue.push(0);
+
+    size_t offset = 0;
+    for (size_t start = 0; start < index->blocks(); start += batch)
+    {
+        size_t blocks = std::min(batch, index->blocks() - start);
+        auto* buffer = buffers[active].get();
+#pragma omp parallel for num_threads(threads)
+        for (size_t i = 0; i < blocks; i++)
+        {
+            size_t block = start + i;
+            sizes[i] = encode_block(records, sorted + block * RUN_BLOCK_RECORDS, index->block_count(block),
+                                    buffer + i * slot, *index, block);
+        }
+
+        size_t bytes = 0;
+        for (size_t i = 0; i < blocks; i++)
+        {
+            std::memmove(buffer + bytes, buffer + i * slot, sizes[i]);
+            index->offsets.push_back(offset + bytes);
+            bytes += sizes[i];
+        }
+
+        notifyQueue.pop();
+        ioQueue.push(IORequest::write(buffer, bytes, offset, &notifyQueue, &writer));
+        offset += bytes;
+        active = 1 - active;
+    }
+    index->offsets.push_back(offset);
+
+    notifyQueue.pop();
+    ioQueue.push(IORequest::last());
+    ioThread.join();
+    writer.preallocate(offset);
+
+    return index;
+}
+
+template <typename Record>
+void write_mmap(const Record* __restrict__ records, const SortRecord<Record>* __restrict__ sorted, ssize_t count,
         const std::string& output, size_t threads)
 {
-    MmapWriter<false> writer(output.c_str(), count);
+    MmapWriter<Record, false> writer(output.c_str(), count);
     auto* __restrict__ target = writer.get_data();
 
-#pragma omp parallel for num_threads(threads / 2)
-    for (ssize_t i = 0; i < count; i++)
+    if (numa_enabled())
     {
-        target[i] = records[sorted[i]];
+        // records were placed by numa_distribute, the output pages are first touched by the writing threads
+        // (the gathers below split the output over the threads in the same way)
+        NumaTraffic traffic;
+        auto nodes = numa_topology().nodes();
+        size_t bytes = count * sizeof(Record);
+#pragma omp parallel num_threads(threads / 2)
+        {
+            auto node = numa_current_node();
+            auto thread = static_cast<size_t>(omp_get_thread_num());
+            auto team = static_cast<size_t>(omp_get_num_threads());
+            size_t start = bytes / sizeof(Record) * thread / team;
+            size_t end = bytes / sizeof(Record) * (thread + 1) / team;
+            size_t remote = 0;
+            for (size_t i = start; i < end; i++)
+            {
+                remote += numa_distributed_node(sorted[i].index * sizeof(Record), bytes, nodes) != node;
+            }
+            traffic.add(end - start, remote);
+        }
+        traffic.print("Write", sizeof(Record));
     }
 
-    /*auto mask = _mm_set1_epi8(0xFF);
-
-#pragma omp parallel for num_threads(threads / 2)
-    for (ssize_t i = 0; i < count; i++)
+    if (get_config().blockedPermutation)
     {
-        auto* ptr = reinterpret_cast<const char*>(records + sorted[i]);
-        auto* dest = reinterpret_cast<char*>(&target[i]);
-        _mm256_storeu_si256((__m256i*)&target[i][0], _mm256_loadu_si256((__m256i*)&(*ptr)[0]));
-        _mm256_storeu_si256((__m256i*)&target[i][32], _mm256_loadu_si256((__m256i*)&(*ptr)[32]));
-        _mm256_storeu_si256((__m256i*)&target[i][64], _mm256_loadu_si256((__m256i*)&(*ptr)[64]));
-        *(reinterpret_cast<uint32_t*>(&target[i][96])) = *(reinterpret_cast<const uint32_t*>(&(*ptr)[96]));
-        _mm_stream_si64(reinterpret_cast<long long int*>(dest), *reinterpret_cast<const long long int*>(ptr));
-        _mm_stream_si64(reinterpret_cast<long long int*>(dest + 8), *reinterpret_cast<const long long int*>(ptr + 8));
-        _mm_stream_si64(reinterpret_cast<long long int*>(dest + 16), *reinterpret_cast<const long long int*>(ptr + 16));
-        _mm_stream_si64(reinterpret_cast<long long int*>(dest + 24), *reinterpret_cast<const long long int*>(ptr + 24));
-        _mm_stream_si64(reinterpret_cast<long long int*>(dest + 32), *reinterpret_cast<const long long int*>(ptr + 32));
-        _mm_stream_si64(reinterpret_cast<long long int*>(dest + 40), *reinterpret_cast<const long long int*>(ptr + 40));
-        _mm_stream_si64(reinterpret_cast<long long int*>(dest + 48), *reinterpret_cast<const long long int*>(ptr + 48));
-        _mm_stream_si64(reinterpret_cast<long long int*>(dest + 56), *reinterpret_cast<const long long int*>(ptr + 56));
-        _mm_stream_si64(reinterpret_cast<long long int*>(dest + 64), *reinterpret_cast<const long long int*>(ptr + 64));
-        _mm_stream_si64(reinterpret_cast<long long int*>(dest + 72), *reinterpret_cast<const long long int*>(ptr + 72));
-        _mm_stream_si64(reinterpret_cast<long long int*>(dest + 80), *reinterpret_cast<const long long int*>(ptr + 80));
-        _mm_stream_si64(reinterpret_cast<long long int*>(dest + 88), *reinterpret_cast<const long long int*>(ptr + 88));
-        _mm_stream_si32(reinterpret_cast<int*>(dest + 96), *reinterpret_cast<const int*>(ptr + 96));
-        _mm_maskmoveu_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr)), mask, dest);
-        _mm_maskmoveu_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr + 16)), mask, dest + 16);
-        _mm_maskmoveu_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr + 32)), mask, dest + 32);
-        _mm_maskmoveu_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr + 48)), mask, dest + 48);
-        _mm_maskmoveu_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr + 64)), mask, dest + 64);
-        _mm_maskmoveu_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr + 80)), mask, dest + 80);
-        _mm_stream_si32(reinterpret_cast<int*>(dest + 96), *reinterpret_cast<const int*>(ptr + 96));
-    }*/
+        gather_records_blocked_parallel(target, records, sorted, count, count, threads / 2);
+    }
+    else gather_records_parallel(target, records, sorted, count, threads / 2);
 }
+
+#define INSTANTIATE(SIZE, OFFSET, KEY)\
+template void write_buffered(const FixedRecord<SIZE, OFFSET, KEY>*, const SortRecord<FixedRecord<SIZE, OFFSET, KEY>>*,\
+        size_t, const std::string&, size_t, size_t);\
+template void write_sequential_io(const FixedRecord<SIZE, OFFSET, KEY>*,\
+        const SortRecord<FixedRecord<SIZE, OFFSET, KEY>>*, size_t, const std::string&, size_t, size_t);\
+template std::shared_ptr<RunIndex> write_compressed_run(const FixedRecord<SIZE, OFFSET, KEY>*,\
+        const SortRecord<FixedRecord<SIZE, OFFSET, KEY>>*, size_t, const std::string&, size_t, size_t);\
+template void write_mmap(const FixedRecord<SIZE, OFFSET, KEY>*, const SortRecord<FixedRecord<SIZE, OFFSET, KEY>>*,\
+        ssize_t, const std::string&, size_t);
+FOR_EACH_RECORD_LAYOUT(INSTANTIATE)
@@ -2,19 +2,33 @@
 
 #include "../record.h"
 
+#include <memory>
 #include <ostream>
+#include <string>
 
+struct RunIndex;
+
+template <typename Record>
 void write_buffered(
-        const Record* records, const SortRecord* sorted, size_t count,
+        const Record* records, const SortRecord<Record>* sorted, size_t count,
         const std::string& output, size_t buffer_size, size_t threads
 );
 
+template <typename Record>
 void write_sequential_io(
-        const Record* records, const SortRecord* sorted, size_t count,
+        const Record* records, const SortRecord<Record>* sorted, size_t count,
+        const std::string& output, size_t buffer_size, size_t threads
+);
+
+// writes the records as a compressed run (see sort/run-format.h), returns its block index
+template <typename Record>
+std::shared_ptr<RunIndex> write_compressed_run(
+        const Record* records, const SortRecord<Record>* sorted, size_t count,
         const std::string& output, size_t buffer_size, size_t threads
 );
 
+template <typename Record>
 void write_mmap(
-        const Record* records, const uint32_t* sorted, ssize_t count,
+        const Record* records, const SortRecord<Record>* sorted, ssize_t count,
         const std::string& output, size_t threads
 );
@@ -2,39 +2,56 @@
 
 #include <fcntl.h>
 #include <cassert>
+#include <cerrno>
 #include <memory>
 #include <unistd.h>
 
 #include "../util.h"
-#include "../record.h"
 
 class MemoryReader {
 public:
-    explicit MemoryReader(const char* path)
+    // counts and offsets of all operations are in records of recordSize bytes
+    // with direct, the file is also opened with O_DIRECT for read_direct
+    MemoryReader(const char* path, size_t recordSize, bool direct = false): recordSize(recordSize)
     {
         this->handle = open(path, O_RDONLY);
         CHECK_NEG_ERROR(this->handle);
         this->size = file_size(this->handle);
+        if (direct)
+        {
+            // without O_DIRECT support in the file system, all reads go through the page cache
+            this->directHandle = open(path, O_RDONLY | O_DIRECT);
+            if (this->directHandle == -1 && errno != EINVAL)
+            {
+                CHECK_NEG_ERROR(this->directHandle);
+            }
+        }
     }
     DISABLE_COPY(MemoryReader);
     ~MemoryReader()
     {
-        if (this->handle != -1)
+        for (int file: { this->handle, this->directHandle })
         {
-            CHECK_NEG_ERROR(close(this->handle));
+            if (file != -1)
+            {
+                CHECK_NEG_ERROR(close(file));
+            }
         }
     }
 
     MemoryReader(MemoryReader&& other) noexcept
     {
         this->size = other.size;
+        this->recordSize = other.recordSize;
         this->handle = other.handle;
+        this->directHandle = other.directHandle;
         other.handle = -1;
+        other.directHandle = -1;
     }
 
-    void read(Record* data, size_t count)
+    void read(void* data, size_t count)
     {
-        size_t size = count * TUPLE_SIZE;
+        size_t size = count * this->recordSize;
         size_t total = 0;
         char* buf = reinterpret_cast<char*>(data);
         while (total < size)
@@ -45,11 +62,11 @@ public:
         }
     }
 
-    void read_at(Record* data, size_t count, size_t offset)
+    void read_at(void* data, size_t count, size_t offset)
     {
-        size_t totalRead = count * TUPLE_SIZE;
+        size_t totalRead = count * this->recordSize;
         size_t currentRead = 0;
-        size_t readOffset = offset * TUPLE_SIZE;
+        size_t readOffset = offset * this->recordSize;
         char* buf = reinterpret_cast<char*>(data);
         while (currentRead < totalRead)
         {
@@ -60,13 +77,39 @@ public:
         }
     }
 
+    // reads size bytes at a byte offset with O_DIRECT (data, size and offset aligned to DIRECT_IO_ALIGNMENT),
+    // or through the page cache if the file was not opened for direct reads
+    void read_direct(void* data, size_t size, size_t offset)
+    {
+        read_bytes(this->directHandle != -1 ? this->directHandle : this->handle, data, size, offset);
+    }
+    // reads size bytes at a byte offset through the page cache
+    void read_bytes_at(void* data, size_t size, size_t offset)
+    {
+        read_bytes(this->handle, data, size, offset);
+    }
+
     void readahead(size_t count, size_t offset)
     {
-        CHECK_NEG_ERROR(::readahead(this->handle, offset * TUPLE_SIZE, count * TUPLE_SIZE));
+        CHECK_NEG_ERROR(::readahead(this->handle, offset * this->recordSize, count * this->recordSize));
     }
     void dontneed(size_t count, size_t offset)
     {
-        CHECK_NEG_ERROR(::posix_fadvise64(this->handle, offset * TUPLE_SIZE, count * TUPLE_SIZE, POSIX_FADV_DONTNEED));
+        CHECK_NEG_ERROR(::posix_fadvise64(this->handle, offset * this->recordSize, count * this->recordSize,
+                                          POSIX_FADV_DONTNEED));
+    }
+
+    int get_handle() const
+    {
+        return this->handle;
+    }
+    int get_direct_handle() const
+    {
+        return this->directHandle;
+    }
+    bool is_direct() const
+    {
+        return this->directHandle != -1;
     }
 
     size_t get_size() const
@@ -74,7 +117,31 @@ public:
         return this->size;
     }
 
+    size_t record_size() const
+    {
+        return this->recordSize;
+    }
+
 private:
+    static void read_bytes(int file, void* data, size_t size, size_t offset)
+    {
+        size_t total = 0;
+        char* buf = reinterpret_cast<char*>(data);
+        while (total < size)
+        {
+            auto readSize = ::pread64(file, buf + total, size - total, offset + total);
+            CHECK_NEG_ERROR(readSize);
+            if (readSize == 0)
+            {
+                errno = EIO;
+                CHECK_NEG_ERROR(-1);
+            }
+            total += readSize;
+        }
+    }
+
     int handle = -1;
+    int directHandle = -1;
     size_t size;
+    size_t recordSize;
 };
@@ -7,6 +7,7 @@
 #include "../util.h"
 #include "../record.h"
 
+template <typename Record>
 class MmapReader {
 public:
     MmapReader() = default;
@@ -9,10 +9,10 @@
 #include "../util.h"
 #include "../record.h"
 
-template <bool Populate = false>
+template <typename Record, bool Populate = false>
 class MmapWriter {
 public:
-    explicit MmapWriter(const char* path, size_t count): size(count * TUPLE_SIZE)
+    explicit MmapWriter(const char* path, size_t count): size(count * sizeof(Record))
     {
         FILE* file = fopen(path, "wb+");
         CHECK_NULL_ERROR(file);
@@ -48,6 +48,20 @@ public:
         CHECK_NEG_ERROR(madvise(this->data, this->size, MADV_RANDOM));
     }
 
+    // unmaps the whole pages of the written records [offset, offset + count), they stay in the page cache until
+    // they are written back, so the output does not add to the resident memory
+    void release(size_t offset, size_t count)
+    {
+        auto start = reinterpret_cast<size_t>(this->data + offset);
+        auto end = reinterpret_cast<size_t>(this->data + offset + count);
+        start = (start + 4095) & ~static_cast<size_t>(4095);
+        end &= ~static_cast<size_t>(4095);
+        if (start < end)
+        {
+            CHECK_NEG_ERROR(madvise(reinterpret_cast<void*>(start), end - start, MADV_DONTNEED));
+        }
+    }
+
 private:
     size_t size;
     Record* data;
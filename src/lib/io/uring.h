@@ -0,0 +1,189 @@
+#pragma once
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <initializer_list>
+#include <memory>
+
+#include "../util.h"
+
+// minimal io_uring wrapper on top of the raw syscalls (liburing is not required)
+// it is only used from a single IO worker thread, so it is not synchronized
+class IOUring {
+public:
+    IOUring() = default;
+    ~IOUring()
+    {
+        if (this->sqRing)
+        {
+            CHECK_NEG_ERROR(munmap(this->sqes, this->sqesSize));
+            if (this->cqRing != this->sqRing)
+            {
+                CHECK_NEG_ERROR(munmap(this->cqRing, this->cqRingSize));
+            }
+            CHECK_NEG_ERROR(munmap(this->sqRing, this->sqRingSize));
+        }
+        if (this->handle != -1)
+        {
+            CHECK_NEG_ERROR(close(this->handle));
+        }
+    }
+    DISABLE_COPY(IOUring);
+    DISABLE_MOVE(IOUring);
+
+    // returns false if io_uring is not available (old kernel, seccomp, etc.)
+    bool init(unsigned int entries)
+    {
+        io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+
+        this->handle = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+        if (this->handle < 0)
+        {
+            this->handle = -1;
+            return false;
+        }
+        if (!this->supports({ IORING_OP_READ, IORING_OP_WRITE })) return false;
+
+        this->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+        this->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool singleMmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (singleMmap)
+        {
+            this->sqRingSize = this->cqRingSize = std::max(this->sqRingSize, this->cqRingSize);
+        }
+
+        this->sqRing = static_cast<uint8_t*>(mmap64(nullptr, this->sqRingSize, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, this->handle, IORING_OFF_SQ_RING));
+        CHECK_NEG_ERROR((ssize_t) this->sqRing);
+        if (singleMmap)
+        {
+            this->cqRing = this->sqRing;
+        }
+        else
+        {
+            this->cqRing = static_cast<uint8_t*>(mmap64(nullptr, this->cqRingSize, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, this->handle, IORING_OFF_CQ_RING));
+            CHECK_NEG_ERROR((ssize_t) this->cqRing);
+        }
+
+        this->sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+        this->sqes = static_cast<io_uring_sqe*>(mmap64(nullptr, this->sqesSize, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, this->handle, IORING_OFF_SQES));
+        CHECK_NEG_ERROR((ssize_t) this->sqes);
+
+        this->sqHead = reinterpret_cast<uint32_t*>(this->sqRing + params.sq_off.head);
+        this->sqTail = reinterpret_cast<uint32_t*>(this->sqRing + params.sq_off.tail);
+        this->sqMask = *reinterpret_cast<uint32_t*>(this->sqRing + params.sq_off.ring_mask);
+        this->sqArray = reinterpret_cast<uint32_t*>(this->sqRing + params.sq_off.array);
+        this->cqHead = reinterpret_cast<uint32_t*>(this->cqRing + params.cq_off.head);
+        this->cqTail = reinterpret_cast<uint32_t*>(this->cqRing + params.cq_off.tail);
+        this->cqMask = *reinterpret_cast<uint32_t*>(this->cqRing + params.cq_off.ring_mask);
+        this->cqes = reinterpret_cast<io_uring_cqe*>(this->cqRing + params.cq_off.cqes);
+
+        this->entries = params.sq_entries;
+        this->localTail = *this->sqTail;
+        return true;
+    }
+
+    size_t capacity() const
+    {
+        return this->entries;
+    }
+
+    // queues a read or write (IORING_OP_READ/IORING_OP_WRITE), returns false if the submission queue is full
+    bool prepare(uint8_t opcode, int fd, void* data, size_t size, size_t offset, uint64_t userData)
+    {
+        uint32_t head = __atomic_load_n(this->sqHead, __ATOMIC_ACQUIRE);
+        if (this->localTail - head >= this->entries) return false;
+
+        uint32_t index = this->localTail & this->sqMask;
+        io_uring_sqe* sqe = &this->sqes[index];
+        std::memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = opcode;
+        sqe->fd = fd;
+        sqe->addr = reinterpret_cast<uint64_t>(data);
+        sqe->len = static_cast<uint32_t>(size);
+        sqe->off = offset;
+        sqe->user_data = userData;
+        this->sqArray[index] = index;
+        this->localTail++;
+        return true;
+    }
+
+    // submits queued entries and optionally waits until at least `wait` completions are available
+    void submit(unsigned int wait)
+    {
+        __atomic_store_n(this->sqTail, this->localTail, __ATOMIC_RELEASE);
+        // entries that were not yet consumed by the kernel (including leftovers from a partial submit)
+        uint32_t toSubmit = this->localTail - __atomic_load_n(this->sqHead, __ATOMIC_ACQUIRE);
+        if (!toSubmit && !wait) return;
+
+        unsigned int flags = wait ? IORING_ENTER_GETEVENTS : 0;
+        while (true)
+        {
+            auto ret = syscall(__NR_io_uring_enter, this->handle, toSubmit, wait, flags, nullptr, 0);
+            if (ret >= 0) break;
+            if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            {
+                CHECK_NEG_ERROR(ret);
+            }
+            toSubmit = this->localTail - __atomic_load_n(this->sqHead, __ATOMIC_ACQUIRE);
+        }
+    }
+
+    // pops a single completion, returns false if there is none
+    bool reap(uint64_t& userData, int32_t& result)
+    {
+        uint32_t head = *this->cqHead;
+        if (head == __atomic_load_n(this->cqTail, __ATOMIC_ACQUIRE)) return false;
+
+        auto& cqe = this->cqes[head & this->cqMask];
+        userData = cqe.user_data;
+        result = cqe.res;
+        __atomic_store_n(this->cqHead, head + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+private:
+    // IORING_OP_READ/IORING_OP_WRITE and the probe were added in 5.6, io_uring itself is available since 5.1
+    bool supports(std::initializer_list<uint8_t> opcodes) const
+    {
+        size_t size = sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op);
+        std::unique_ptr<uint8_t[]> data(new uint8_t[size]());
+        auto* probe = reinterpret_cast<io_uring_probe*>(data.get());
+        if (syscall(__NR_io_uring_register, this->handle, IORING_REGISTER_PROBE, probe, 256) < 0) return false;
+
+        for (auto opcode: opcodes)
+        {
+            if (opcode > probe->last_op || !(probe->ops[opcode].flags & IO_URING_OP_SUPPORTED)) return false;
+        }
+        return true;
+    }
+
+    int handle = -1;
+    uint32_t entries = 0;
+
+    uint8_t* sqRing = nullptr;
+    uint8_t* cqRing = nullptr;
+    io_uring_sqe* sqes = nullptr;
+    size_t sqRingSize = 0;
+    size_t cqRingSize = 0;
+    size_t sqesSize = 0;
+
+    uint32_t* sqHead = nullptr;
+    uint32_t* sqTail = nullptr;
+    uint32_t* sqArray = nullptr;
+    uint32_t sqMask = 0;
+    uint32_t localTail = 0;
+
+    uint32_t* cqHead = nullptr;
+    uint32_t* cqTail = nullptr;
+    io_uring_cqe* cqes = nullptr;
+    uint32_t cqMask = 0;
+};
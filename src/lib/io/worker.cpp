@@ -1,12 +1,25 @@
 #include "worker.h"
+#include "uring.h"
 #include "../sort/buffer.h"
 
 #include <atomic>
+#include <deque>
 
 extern std::atomic<size_t> bufferIORead;
 extern std::atomic<size_t> bufferIOWrite;
 
-std::thread ioWorker(SyncQueue<IORequest>& ioQueue)
+static std::atomic<IOBackend> ioBackend{IOBackend::Uring};
+
+void set_io_backend(IOBackend backend)
+{
+    ioBackend = backend;
+}
+IOBackend get_io_backend()
+{
+    return ioBackend;
+}
+
+static std::thread ioWorkerSync(SyncQueue<IORequest>& ioQueue)
 {
     return std::thread([&ioQueue]() {
         size_t lastWrite = 0;
@@ -31,6 +44,11 @@ std::thread ioWorker(SyncQueue<IORequest>& ioQueue)
                     request.readBuffer->read_from_source(request.count);
                     std::cerr << "Read buffer " << request.count << " in " << timerIO.get() << " ms" << std::endl;
                 }
+                else if (request.type == IORequest::Type::Prefetch)
+                {
+                    request.readBuffer->fill_spare();
+                    bufferIORead += timerIO.get();
+                }
                 else if (request.type == IORequest::Type::Write)
                 {
                     request.writer->write_at(request.buffer, request.count, request.offset);
@@ -47,3 +65,252 @@ std::thread ioWorker(SyncQueue<IORequest>& ioQueue)
         }
     });
 }
+
+namespace {
+    struct UringRequest {
+        explicit UringRequest(const IORequest& request): request(request)
+        {
+
+        }
+
+        IORequest request;
+        size_t pending = 0;         // number of segments that were not completed yet
+        size_t transferCount = 0;   // number of records transferred by a ReadBuffer request
+        size_t previousCount = 0;   // size of the previous write, used by WriteDiscard
+        Timer timer;
+    };
+
+    struct UringSegment {
+        UringRequest* owner;
+        uint8_t opcode;
+        int fd;
+        char* data;
+        size_t size;
+        size_t offset;
+    };
+}
+
+static void finish_uring_request(UringRequest* pending)
+{
+    auto& request = pending->request;
+    if (request.type == IORequest::Type::Read)
+    {
+        std::cerr << "Read " << request.count << " in " << pending->timer.get() << " ms" << std::endl;
+        bufferIORead += pending->timer.get();
+    }
+    else if (request.type == IORequest::Type::ReadBuffer)
+    {
+        request.readBuffer->finish_read(pending->transferCount);
+        std::cerr << "Read buffer " << request.count << " in " << pending->timer.get() << " ms" << std::endl;
+    }
+    else if (request.type == IORequest::Type::Prefetch)
+    {
+        auto* buffer = request.readBuffer;
+        if (!buffer->direct())
+        {
+            buffer->reader->dontneed(buffer->prefetchCount, buffer->prefetchOffset);
+        }
+        bufferIORead += pending->timer.get();
+    }
+    else if (request.type == IORequest::Type::Write)
+    {
+        bufferIOWrite += pending->timer.get();
+    }
+    else
+    {
+        request.writer->discard_behind(request.offset, pending->previousCount, 5);
+        bufferIOWrite += pending->timer.get();
+    }
+
+    request.queue->push(request.count);
+    delete pending;
+}
+
+static void run_uring_worker(IOUring& ring, SyncQueue<IORequest>& ioQueue)
+{
+    std::deque<UringSegment*> waiting;
+    size_t inFlight = 0;
+    size_t active = 0;
+    size_t lastWrite = 0;
+    bool end = false;
+
+    // splits the request into segments so that a single large request also keeps multiple operations in flight
+    auto enqueue = [&waiting](UringRequest* pending, uint8_t opcode, int fd, void* data,
+            size_t recordSize, size_t count, size_t offset) {
+        auto* address = reinterpret_cast<char*>(data);
+        size_t size = count * recordSize;
+        size_t byteOffset = offset * recordSize;
+        for (size_t start = 0; start < size; start += IO_URING_SEGMENT_SIZE)
+        {
+            size_t segmentSize = std::min(static_cast<size_t>(IO_URING_SEGMENT_SIZE), size - start);
+            waiting.push_back(new UringSegment{ pending, opcode, fd, address + start, segmentSize,
+                                                byteOffset + start });
+            pending->pending++;
+        }
+    };
+
+    // reads count records at the given position of the buffer's run into target, returns the offset of the
+    // first record in target
+    auto enqueue_buffer = [&enqueue](UringRequest* pending, ReadBuffer* buffer, uint8_t* target, size_t count,
+            size_t position) -> size_t {
+        if (buffer->direct())
+        {
+            // whole blocks with O_DIRECT, the partial last block of the file through the page cache
+            auto read = buffer->plan_direct_read(count, position);
+            enqueue(pending, IORING_OP_READ, buffer->reader->get_direct_handle(), target, 1, read.directSize,
+                    read.offset);
+            enqueue(pending, IORING_OP_READ, buffer->reader->get_handle(), target + read.directSize, 1,
+                    read.tailSize, read.offset + read.directSize);
+            return read.head;
+        }
+        enqueue(pending, IORING_OP_READ, buffer->reader->get_handle(), target, buffer->reader->record_size(), count,
+                position);
+        return 0;
+    };
+
+    auto handle = [&](const IORequest& request) {
+        if (request.isLast())
+        {
+            end = true;
+            return;
+        }
+        if (!request.count)
+        {
+            request.queue->push(request.count);
+            return;
+        }
+
+        auto* pending = new UringRequest(request);
+        if (request.type == IORequest::Type::Read)
+        {
+            enqueue(pending, IORING_OP_READ, request.reader->get_handle(), request.buffer,
+                    request.reader->record_size(), request.count, request.offset);
+        }
+        else if (request.type == IORequest::Type::ReadBuffer)
+        {
+            auto* buffer = request.readBuffer;
+            size_t left = buffer->next_read_count(request.count);
+            if (!buffer->reader || !left || buffer->index)
+            {
+                // in-memory buffers and exhausted buffers do not need any disk IO,
+                // compressed runs are read block by block and decoded
+                buffer->read_from_source(request.count);
+                request.queue->push(request.count);
+                delete pending;
+                return;
+            }
+            pending->transferCount = left;
+            buffer->directHead = enqueue_buffer(pending, buffer, buffer->data.get(), left, buffer->read_offset());
+        }
+        else if (request.type == IORequest::Type::Prefetch)
+        {
+            auto* buffer = request.readBuffer;
+            if (buffer->index)
+            {
+                // compressed runs are decoded by the worker thread
+                buffer->fill_spare();
+                request.queue->push(request.count);
+                delete pending;
+                return;
+            }
+            buffer->spareHead = enqueue_buffer(pending, buffer, buffer->spare.get(), buffer->prefetchCount,
+                                               buffer->prefetchOffset);
+        }
+        else
+        {
+            if (request.type == IORequest::Type::WriteDiscard)
+            {
+                pending->previousCount = lastWrite;
+                lastWrite = request.count;
+            }
+            enqueue(pending, IORING_OP_WRITE, request.writer->get_handle(), request.buffer,
+                    request.writer->record_size(), request.count, request.offset);
+        }
+        active++;
+    };
+
+    while (true)
+    {
+        if (!end)
+        {
+            auto request = IORequest::last();
+            if (!active)
+            {
+                // nothing is in flight, block until there is something to do
+                handle(ioQueue.pop());
+            }
+            while (!end && ioQueue.try_pop(request))
+            {
+                handle(request);
+            }
+        }
+        if (end && !active) break;
+
+        while (!waiting.empty() && inFlight < ring.capacity())
+        {
+            auto* segment = waiting.front();
+            if (!ring.prepare(segment->opcode, segment->fd, segment->data, segment->size, segment->offset,
+                    reinterpret_cast<uint64_t>(segment))) break;
+            waiting.pop_front();
+            inFlight++;
+        }
+        if (!inFlight) continue;
+
+        ring.submit(1);
+
+        uint64_t userData;
+        int32_t result;
+        while (ring.reap(userData, result))
+        {
+            inFlight--;
+            auto* segment = reinterpret_cast<UringSegment*>(userData);
+            if (result == -EAGAIN || result == -EINTR)
+            {
+                waiting.push_front(segment);
+                continue;
+            }
+            if (result <= 0)
+            {
+                errno = result == 0 ? EIO : -result;
+                CHECK_NEG_ERROR(-1);
+            }
+
+            auto transferred = static_cast<size_t>(result);
+            if (transferred < segment->size)
+            {
+                // short read/write, resubmit the rest
+                segment->data += transferred;
+                segment->offset += transferred;
+                segment->size -= transferred;
+                waiting.push_front(segment);
+                continue;
+            }
+
+            auto* pending = segment->owner;
+            delete segment;
+            if (--pending->pending == 0)
+            {
+                active--;
+                finish_uring_request(pending);
+            }
+        }
+    }
+}
+
+std::thread ioWorker(SyncQueue<IORequest>& ioQueue)
+{
+    if (ioBackend == IOBackend::Uring)
+    {
+        std::unique_ptr<IOUring> ring(new IOUring());
+        if (ring->init(IO_URING_QUEUE_DEPTH))
+        {
+            return std::thread([&ioQueue](std::unique_ptr<IOUring> ring) {
+                run_uring_worker(*ring, ioQueue);
+            }, std::move(ring));
+        }
+
+        std::cerr << "io_uring is not available, falling back to synchronous IO" << std::endl;
+        ioBackend = IOBackend::Sync;
+    }
+    return ioWorkerSync(ioQueue);
+}
@@ -1,27 +1,24 @@
 #pragma once
 
-#pragma once
-
 #include <thread>
-#include "../record.h"
 #include "../sync.h"
 #include "memory-reader.h"
 #include "file-writer.h"
 
 class ReadBuffer;
-class WriteBuffer;
 
 class IORequest {
 public:
     enum class Type {
         Read,
         ReadBuffer,
+        Prefetch,
         Write,
         WriteDiscard,
         End
     };
 
-    static IORequest read(Record* buffer,
+    static IORequest read(void* buffer,
                           size_t count,
                           size_t offset,
                           SyncQueue<size_t>* queue,
@@ -31,7 +28,7 @@ public:
         req.reader = reader;
         return req;
     }
-    static IORequest write(Record* buffer,
+    static IORequest write(void* buffer,
                           size_t count,
                           size_t offset,
                           SyncQueue<size_t>* queue,
@@ -41,7 +38,7 @@ public:
         req.writer = writer;
         return req;
     }
-    static IORequest write_discard(Record* buffer,
+    static IORequest write_discard(void* buffer,
                            size_t count,
                            size_t offset,
                            SyncQueue<size_t>* queue,
@@ -60,6 +57,16 @@ public:
         return req;
     }
 
+    // read-ahead of a merge run into the spare half of its buffer (see ReadBuffer::prefetch)
+    static IORequest prefetch_buffer(size_t count,
+                          SyncQueue<size_t>* queue,
+                          ReadBuffer* readBuffer)
+    {
+        IORequest req(Type::Prefetch, nullptr, count, 0, queue);
+        req.readBuffer = readBuffer;
+        return req;
+    }
+
     static IORequest last()
     {
         return {};
@@ -70,7 +77,7 @@ public:
         return this->type == Type::End;
     }
 
-    Record* buffer;
+    void* buffer;
     size_t count;
     size_t offset;
     SyncQueue<size_t>* queue;
@@ -88,7 +95,7 @@ private:
 
     }
     IORequest(Type type,
-            Record* buffer,
+            void* buffer,
             size_t count,
             size_t offset,
             SyncQueue<size_t>* queue):
@@ -98,4 +105,13 @@ private:
     }
 };
 
+enum class IOBackend {
+    Sync,   // blocking pread/pwrite, one request at a time
+    Uring   // io_uring, many requests (and request segments) in flight
+};
+
+void set_io_backend(IOBackend backend);
+IOBackend get_io_backend();
+
+// starts an IO thread using the selected backend (falls back to Sync if io_uring is not available)
 std::thread ioWorker(SyncQueue<IORequest>& ioQueue);
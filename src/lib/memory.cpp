@@ -0,0 +1,199 @@
+#include "memory.h"
+#include "config.h"
+#include "../settings.h"
+
+#include <map>
+#include <mutex>
+#include <omp.h>
+#include <unistd.h>
+
+namespace {
+    class MemoryArena {
+    public:
+        void* allocate(size_t size)
+        {
+            if (!size) return nullptr;
+            if (size < ARENA_ALIGNMENT) return map(size);
+            size = round_up(size);
+
+            char* data = nullptr;
+            {
+                std::lock_guard<std::mutex> lock(this->mutex);
+                this->reserve();
+
+                // first fit, so that the low part of the arena is used first
+                for (auto it = this->free.begin(); it != this->free.end(); ++it)
+                {
+                    if (it->second < size) continue;
+
+                    size_t offset = it->first;
+                    size_t left = it->second - size;
+                    this->free.erase(it);
+                    if (left)
+                    {
+                        this->free[offset + size] = left;
+                    }
+                    data = this->base + offset;
+                    break;
+                }
+            }
+
+            if (!data) return map(size);
+
+            // free ranges of the arena are not backed by memory
+            this->prefault(data, data + size);
+            return data;
+        }
+
+        void release(void* data, size_t size)
+        {
+            if (!size) return;
+
+            auto* address = static_cast<char*>(data);
+            if (!this->contains(address))
+            {
+                CHECK_NEG_ERROR(munmap(data, size));
+                return;
+            }
+
+            // the memory is given back before the range can be allocated again
+            size = round_up(size);
+            CHECK_NEG_ERROR(madvise(address, size, MADV_DONTNEED));
+
+            std::lock_guard<std::mutex> lock(this->mutex);
+            size_t offset = static_cast<size_t>(address - this->base);
+
+            // merge with the neighbouring free ranges
+            auto next = this->free.lower_bound(offset);
+            if (next != this->free.end() && next->first == offset + size)
+            {
+                size += next->second;
+                next = this->free.erase(next);
+            }
+            if (next != this->free.begin())
+            {
+                auto previous = std::prev(next);
+                if (previous->first + previous->second == offset)
+                {
+                    previous->second += size;
+                    return;
+                }
+            }
+            this->free[offset] = size;
+        }
+
+        void shrink(void* data, size_t size, size_t newSize)
+        {
+            auto* address = static_cast<char*>(data);
+            if (!this->contains(address))
+            {
+                // separate mappings are released by whole pages
+                size_t page = page_size();
+                size_t end = (newSize + page - 1) / page * page;
+                if (end < size)
+                {
+                    CHECK_NEG_ERROR(munmap(address + end, size - end));
+                }
+                return;
+            }
+
+            size = round_up(size);
+            newSize = round_up(newSize);
+            if (newSize >= size) return;
+            this->release(address + newSize, size - newSize);
+        }
+
+        static size_t footprint(size_t size)
+        {
+            if (size < ARENA_ALIGNMENT) return (size + page_size() - 1) / page_size() * page_size();
+            return round_up(size);
+        }
+
+    private:
+        static size_t round_up(size_t size)
+        {
+            return (size + ARENA_ALIGNMENT - 1) / ARENA_ALIGNMENT * ARENA_ALIGNMENT;
+        }
+
+        static size_t page_size()
+        {
+            return static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        }
+
+        // separate mapping for small buffers and for requests that do not fit into the arena,
+        // its pages are faulted in when they are touched
+        static char* map(size_t size)
+        {
+            auto* data = static_cast<char*>(mmap64(nullptr, size, PROT_READ | PROT_WRITE,
+                                                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+            CHECK_NEG_ERROR((ssize_t) data);
+            if (size >= ARENA_ALIGNMENT)
+            {
+                CHECK_NEG_ERROR(madvise(data, size, MADV_HUGEPAGE));
+            }
+            return data;
+        }
+
+        bool contains(const char* address) const
+        {
+            return this->base && address >= this->base && address < this->base + this->capacity;
+        }
+
+        void reserve()
+        {
+            if (this->base || !get_config().memoryLimit) return;
+
+            // only address space is reserved, pages are allocated when they are touched
+            this->capacity = round_up(get_config().memoryLimit);
+            auto* data = static_cast<char*>(mmap64(nullptr, this->capacity + ARENA_ALIGNMENT, PROT_READ | PROT_WRITE,
+                                                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0));
+            CHECK_NEG_ERROR((ssize_t) data);
+            // huge pages need an aligned start
+            this->base = reinterpret_cast<char*>(round_up(reinterpret_cast<size_t>(data)));
+            CHECK_NEG_ERROR(madvise(this->base, this->capacity, MADV_HUGEPAGE));
+            this->free[0] = this->capacity;
+        }
+
+        // touches every page of [begin, end) in parallel, with a static schedule the pages end up on the NUMA nodes
+        // of the touching threads in the same blocks as numa_distribute
+        void prefault(char* begin, char* end)
+        {
+            if (begin >= end) return;
+
+            Timer timerFault;
+            auto page = static_cast<ssize_t>(page_size());
+            auto pages = (end - begin) / page;
+#pragma omp parallel for num_threads(omp_get_max_threads()) schedule(static)
+            for (ssize_t i = 0; i < pages; i++)
+            {
+                begin[i * page] = 0;
+            }
+            std::cerr << "Arena: pre-faulted " << (end - begin) / (1024 * 1024) << " MiB in " << timerFault.get()
+                      << " ms" << std::endl;
+        }
+
+        std::mutex mutex;
+        char* base = nullptr;
+        size_t capacity = 0;
+        std::map<size_t, size_t> free;  // offset -> size of the free ranges
+    };
+
+    MemoryArena arena;
+}
+
+void* arena_allocate(size_t size)
+{
+    return arena.allocate(size);
+}
+void arena_release(void* data, size_t size)
+{
+    arena.release(data, size);
+}
+void arena_shrink(void* data, size_t size, size_t newSize)
+{
+    arena.shrink(data, size, newSize);
+}
+size_t arena_footprint(size_t size)
+{
+    return MemoryArena::footprint(size);
+}
@@ -1,8 +1,21 @@
 #pragma once
 
 #include <sys/mman.h>
+#include <cassert>
+#include <utility>
 #include "util.h"
 
+// Process-wide arena for large buffers. The address space of the memory budget is reserved once (huge pages),
+// buffers are carved from it without mmap/munmap and pre-faulted by all threads. Released ranges are given back to
+// the OS (MADV_DONTNEED), so that the resident memory follows the live buffers. Buffers smaller than ARENA_ALIGNMENT
+// and requests that do not fit into the reservation get a separate mapping.
+void* arena_allocate(size_t size);
+void arena_release(void* data, size_t size);
+// returns the end of the allocation after newSize bytes to the arena
+void arena_shrink(void* data, size_t size, size_t newSize);
+// resident memory of an allocation of size bytes (rounded to pages, or to ARENA_ALIGNMENT in the arena)
+size_t arena_footprint(size_t size);
+
 template <typename T>
 class HugePageBuffer
 {
@@ -27,7 +40,7 @@ public:
     {
         if (this->data)
         {
-            CHECK_NEG_ERROR(munmap(this->data, this->count * sizeof(T)));
+            arena_release(this->data, this->count * sizeof(T));
         }
     }
 
@@ -39,10 +52,7 @@ public:
     void allocate(size_t count)
     {
         assert(this->data == nullptr);
-        this->data = static_cast<T*>(mmap64(nullptr, count * sizeof(T), PROT_READ | PROT_WRITE,
-                                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
-        CHECK_NEG_ERROR((ssize_t) this->data);
-        CHECK_NEG_ERROR(madvise(this->data, count * sizeof(T), MADV_HUGEPAGE));
+        this->data = static_cast<T*>(arena_allocate(count * sizeof(T)));
         this->count = count;
     }
 
@@ -50,20 +60,23 @@ public:
     {
         if (newCount < this->count)
         {
-            CHECK_NEG_ERROR(mremap(
-                    this->data, this->count * sizeof(T),
-                    newCount * sizeof(T),
-                    0));
+            arena_shrink(this->data, this->count * sizeof(T), newCount * sizeof(T));
             this->count = newCount;
         }
     }
 
     void deallocate()
     {
-        CHECK_NEG_ERROR(munmap(this->data, this->count * sizeof(T)));
+        arena_release(this->data, this->count * sizeof(T));
         this->data = nullptr;
     }
 
+    void swap(HugePageBuffer& other)
+    {
+        std::swap(this->data, other.data);
+        std::swap(this->count, other.count);
+    }
+
 private:
     T* data = nullptr;
     size_t count = 0;
@@ -0,0 +1,165 @@
+#include "numa.h"
+#include "config.h"
+#include "util.h"
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <linux/mempolicy.h>
+#include <omp.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static thread_local size_t currentNode = 0;
+static std::atomic<bool> placementFailed{false};
+
+// parses sysfs lists like 0-9,20-29
+static std::vector<int> parse_list(const std::string& list)
+{
+    std::vector<int> values;
+    std::stringstream stream(list);
+    std::string item;
+    while (std::getline(stream, item, ','))
+    {
+        if (item.empty() || item == "\n") continue;
+        auto separator = item.find('-');
+        int first = std::stoi(item.substr(0, separator));
+        int last = separator == std::string::npos ? first : std::stoi(item.substr(separator + 1));
+        for (int value = first; value <= last; value++)
+        {
+            values.push_back(value);
+        }
+    }
+    return values;
+}
+
+static std::string read_line(const std::string& path)
+{
+    std::ifstream file(path);
+    std::string line;
+    std::getline(file, line);
+    return line;
+}
+
+static NumaTopology read_topology()
+{
+    NumaTopology topology;
+
+    // only CPUs allowed by the affinity of the process (e.g. taskset) are used
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    CHECK_NEG_ERROR(sched_getaffinity(0, sizeof(allowed), &allowed));
+
+    for (int node: parse_list(read_line("/sys/devices/system/node/online")))
+    {
+        std::vector<int> cpus;
+        auto path = "/sys/devices/system/node/node" + std::to_string(node) + "/cpulist";
+        for (int cpu: parse_list(read_line(path)))
+        {
+            if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed))
+            {
+                cpus.push_back(cpu);
+            }
+        }
+        if (!cpus.empty())
+        {
+            topology.ids.push_back(node);
+            topology.cpus.push_back(std::move(cpus));
+        }
+    }
+    return topology;
+}
+
+const NumaTopology& numa_topology()
+{
+    static NumaTopology topology = read_topology();
+    return topology;
+}
+
+bool numa_enabled()
+{
+    return get_config().numa && numa_topology().nodes() > 1;
+}
+
+void numa_bind_threads(size_t threads)
+{
+    if (!numa_enabled()) return;
+
+    auto& topology = numa_topology();
+    std::cerr << "NUMA nodes:";
+    for (size_t i = 0; i < topology.nodes(); i++)
+    {
+        std::cerr << " " << topology.ids[i] << " (" << topology.cpus[i].size() << " CPUs)";
+    }
+    std::cerr << std::endl;
+
+#pragma omp parallel num_threads(threads)
+    {
+        auto node = static_cast<size_t>(omp_get_thread_num()) * topology.nodes() / threads;
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        for (int cpu: topology.cpus[node])
+        {
+            CPU_SET(cpu, &cpuset);
+        }
+        CHECK_NEG_ERROR(pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset));
+        currentNode = node;
+    }
+}
+
+size_t numa_current_node()
+{
+    return currentNode;
+}
+
+static void set_policy(const void* data, size_t size, int mode, const std::vector<int>& nodes)
+{
+    // mbind works on whole pages, partial pages at the ends keep the default policy
+    auto page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    auto begin = (reinterpret_cast<size_t>(data) + page - 1) / page * page;
+    auto end = (reinterpret_cast<size_t>(data) + size) / page * page;
+    if (end <= begin || placementFailed) return;
+
+    unsigned long mask[16] = {};
+    for (int node: nodes)
+    {
+        mask[node / 64] |= 1ul << (node % 64);
+    }
+    if (syscall(SYS_mbind, begin, end - begin, mode, mask, sizeof(mask) * 8, 0) < 0 && !placementFailed.exchange(true))
+    {
+        // e.g. forbidden by a container, the sort still works without placement
+        perror("mbind");
+        std::cerr << "NUMA memory placement disabled" << std::endl;
+    }
+}
+
+void numa_distribute(const void* data, size_t size)
+{
+    if (!numa_enabled()) return;
+
+    auto& topology = numa_topology();
+    auto nodes = topology.nodes();
+    auto* bytes = static_cast<const char*>(data);
+    for (size_t k = 0; k < nodes; k++)
+    {
+        size_t start = size * k / nodes;
+        size_t end = size * (k + 1) / nodes;
+        set_policy(bytes + start, end - start, MPOL_PREFERRED, { topology.ids[k] });
+    }
+}
+
+void numa_interleave(const void* data, size_t size)
+{
+    if (!numa_enabled()) return;
+    set_policy(data, size, MPOL_INTERLEAVE, numa_topology().ids);
+}
+
+void NumaTraffic::print(const std::string& name, size_t accessSize) const
+{
+    size_t total = this->accesses;
+    size_t remote = this->remote;
+    std::cerr << name << " cross-node reads: " << remote * accessSize / (1024 * 1024) << " MiB of "
+              << total * accessSize / (1024 * 1024) << " MiB (" << (total ? remote * 100 / total : 0) << "%)"
+              << std::endl;
+}
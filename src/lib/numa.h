@@ -0,0 +1,58 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// NUMA topology read from sysfs (/sys/devices/system/node), memory policies are set with the mbind system call,
+// so libnuma is not needed.
+// OpenMP threads are bound to the nodes in contiguous blocks of thread ids (numa_bind_threads) and buffers that are
+// processed with a static schedule are split over the nodes in the same contiguous blocks (numa_distribute),
+// so that every thread works on memory of its own node.
+struct NumaTopology {
+    size_t nodes() const
+    {
+        return this->ids.size();
+    }
+
+    std::vector<int> ids;                   // nodes that have CPUs usable by this process
+    std::vector<std::vector<int>> cpus;     // usable CPUs of every node
+};
+
+const NumaTopology& numa_topology();
+
+// true if there are multiple usable nodes and NUMA placement was not disabled (see Config::numa)
+bool numa_enabled();
+
+// binds thread t of an OpenMP team of the given size to node t * nodes / threads
+void numa_bind_threads(size_t threads);
+// node index (into NumaTopology::ids) of the calling thread, 0 for threads that were not bound
+size_t numa_current_node();
+
+// places the pages of [data, data + size) on the nodes in contiguous blocks, block k on node k
+void numa_distribute(const void* data, size_t size);
+// interleaves the pages of [data, data + size) over all nodes, for buffers without a thread affinity
+void numa_interleave(const void* data, size_t size);
+
+// node of a byte at offset of a buffer of size bytes that was placed by numa_distribute
+inline size_t numa_distributed_node(size_t offset, size_t size, size_t nodes)
+{
+    return size ? offset * nodes / size : 0;
+}
+
+// counts accesses to buffers placed by numa_distribute that hit the memory of another node
+class NumaTraffic {
+public:
+    void add(size_t accesses, size_t remote)
+    {
+        this->accesses += accesses;
+        this->remote += remote;
+    }
+
+    void print(const std::string& name, size_t accessSize) const;
+
+private:
+    std::atomic<size_t> accesses{0};
+    std::atomic<size_t> remote{0};
+};
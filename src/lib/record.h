@@ -2,20 +2,105 @@
 
 #include <array>
 #include <cstdint>
+#include <cstddef>
+#include <cstring>
 
-const size_t TUPLE_SIZE = 100;
-const size_t KEY_SIZE = 10;
+// record of Size bytes with a key of KeySize bytes at KeyOffset, keys are compared as big-endian byte strings
+// the layout is a compile-time parameter of all sort, merge and IO kernels, so their inner loops are specialized
+// for it (the compiled layouts are listed in FOR_EACH_RECORD_LAYOUT, see settings.h)
+template <size_t Size, size_t KeyOffset, size_t KeySize>
+struct FixedRecord: public std::array<uint8_t, Size> {
+    static_assert(KeyOffset + KeySize <= Size, "The key has to be inside of the record");
+    static_assert(KeySize > 0, "The key cannot be empty");
 
-using Record = std::array<uint8_t, TUPLE_SIZE>;
-using Header = std::array<uint8_t, KEY_SIZE>;
+    static constexpr size_t SIZE = Size;
+    static constexpr size_t KEY_OFFSET = KeyOffset;
+    static constexpr size_t KEY_SIZE = KeySize;
 
+    using Header = std::array<uint8_t, KeySize>;
+};
+
+template <size_t Size, size_t KeyOffset, size_t KeySize>
+constexpr size_t FixedRecord<Size, KeyOffset, KeySize>::SIZE;
+template <size_t Size, size_t KeyOffset, size_t KeySize>
+constexpr size_t FixedRecord<Size, KeyOffset, KeySize>::KEY_OFFSET;
+template <size_t Size, size_t KeyOffset, size_t KeySize>
+constexpr size_t FixedRecord<Size, KeyOffset, KeySize>::KEY_SIZE;
+
+// 100 byte records with a 10 byte key at the start
+using DefaultRecord = FixedRecord<100, 0, 10>;
+
+// unsigned type that holds the key bytes that follow the last whole 8-byte word of the key
+template <size_t Bytes> struct KeyTail { using type = uint64_t; };
+template <> struct KeyTail<0> { using type = uint8_t; };
+template <> struct KeyTail<1> { using type = uint8_t; };
+template <> struct KeyTail<2> { using type = uint16_t; };
+template <> struct KeyTail<3> { using type = uint32_t; };
+template <> struct KeyTail<4> { using type = uint32_t; };
+
+// size of SortRecord for the given key size
+constexpr size_t sort_record_size(size_t keySize)
+{
+    return (keySize / 8 * 8 + (keySize % 8 > 4 ? 8 : keySize % 8 > 2 ? 4 : keySize % 8 == 2 ? 2 : 1) +
+            sizeof(uint32_t) + 7) / 8 * 8;
+}
+
+// key and index of a record used by the sort kernels
+// the key is normalized once when it is extracted: 8-byte words are byte swapped into native integers and the
+// remaining bytes form a big-endian tail, so comparisons and radix digits do not need any byte swaps or unaligned
+// loads and the element is naturally aligned (16 bytes for keys of up to 10 bytes)
+template <typename Record>
 struct SortRecord {
+    using Header = typename Record::Header;
+    static constexpr size_t WORDS = Record::KEY_SIZE / 8;
+    static constexpr size_t TAIL_BYTES = Record::KEY_SIZE % 8;
+    using Tail = typename KeyTail<TAIL_BYTES>::type;
+
     SortRecord() = default;
-    SortRecord(const Header& header, uint32_t index): header(header), index(index)
+    SortRecord(const Header& header, uint32_t index): index(index)
     {
+        this->set_key(header);
+    }
 
+    void set_key(const Header& header)
+    {
+        for (size_t i = 0; i < WORDS; i++)
+        {
+            uint64_t word;
+            std::memcpy(&word, header.data() + i * 8, sizeof(word));
+            this->prefix[i] = __builtin_bswap64(word);
+        }
+        uint64_t tail = 0;
+        for (size_t i = 0; i < TAIL_BYTES; i++)
+        {
+            tail = (tail << 8) | header[WORDS * 8 + i];
+        }
+        this->tail = static_cast<Tail>(tail);
+    }
+
+    // k-th byte of the key
+    uint8_t key_byte(size_t k) const
+    {
+        return k < WORDS * 8 ? static_cast<uint8_t>(this->prefix[k / 8] >> (56 - 8 * (k % 8)))
+                             : static_cast<uint8_t>(this->tail >> (8 * (WORDS * 8 + TAIL_BYTES - 1 - k)));
+    }
+
+    // the last (up to) 8 key bytes as a big-endian integer
+    uint64_t key_suffix() const
+    {
+        return WORDS > 0 ? (this->prefix[WORDS - 1] << (8 * TAIL_BYTES)) | this->tail : this->tail;
+    }
+
+    bool operator<(const SortRecord& other) const
+    {
+        for (size_t i = 0; i < WORDS; i++)
+        {
+            if (this->prefix[i] != other.prefix[i]) return this->prefix[i] < other.prefix[i];
+        }
+        return this->tail < other.tail;
     }
 
-    Header header;
+    std::array<uint64_t, WORDS> prefix;
+    Tail tail;
     uint32_t index;
-} __attribute__((packed));
+};
@@ -3,12 +3,16 @@
 #include <memory>
 #include <atomic>
 #include <cmath>
+#include <cstring>
 
 #include "../record.h"
 #include "../../settings.h"
 #include "../io/memory-reader.h"
 #include "../io/file-writer.h"
+#include "../io/worker.h"
 #include "../memory.h"
+#include "../config.h"
+#include "run-format.h"
 
 extern std::atomic<size_t> bufferIORead;
 extern std::atomic<size_t> bufferIOWrite;
@@ -49,17 +53,26 @@ public:
     size_t fileOffset = 0;
 };
 
+// buffer of records of a single run, the records are accessed with load<Record>() by the (typed) merge kernels
+// and the buffer is refilled by the (untyped) IO worker
+// records of compressed runs (with a block index) are decoded while they are read, their reader reads bytes
+// readers opened for direct IO read whole blocks, the records then start at the offset of the first record within
+// its block (memory is data + directHead)
 struct ReadBuffer: public Buffer {
-    explicit ReadBuffer(size_t bufferSize, size_t fileOffset, size_t totalSize, MemoryReader* reader)
-    : Buffer(bufferSize), data(bufferSize), reader(reader)
+    explicit ReadBuffer(size_t bufferSize, size_t fileOffset, size_t totalSize, MemoryReader* reader,
+                        const RunIndex* index = nullptr, const RunFences* fences = nullptr)
+    : Buffer(bufferSize), reader(reader), index(index), fences(fences), capacity(bufferSize),
+      recordSize(index ? index->recordSize : reader->record_size())
     {
+        this->data.allocate(bufferSize * this->recordSize + (this->direct() ? 2 * DIRECT_IO_ALIGNMENT : 0));
         this->fileOffset = fileOffset;
         this->totalSize = totalSize;
         this->memory = this->data.get();
     }
 
+    template <typename Record>
     explicit ReadBuffer(Record* memory, size_t memorySize)
-            : Buffer(memorySize), memory(memory)
+            : Buffer(memorySize), memory(reinterpret_cast<uint8_t*>(memory)), recordSize(sizeof(Record))
     {
         this->totalSize = memorySize;
         this->chunk = std::ceil(memorySize / (double) MERGE_INMEMORY_SPLIT_PARTS);
@@ -67,25 +80,35 @@ struct ReadBuffer: public Buffer {
         this->size = this->chunk;
     }
 
+    template <typename Record>
     const Record& load() const
     {
-        return this->memory[this->offset];
+        return this->records<Record>()[this->offset];
+    }
+
+    template <typename Record>
+    Record* records() const
+    {
+        return reinterpret_cast<Record*>(this->memory);
     }
 
     size_t read_from_source(size_t size)
     {
-        auto left = this->left();
-        left = std::min(left, static_cast<size_t>(size));
+        auto left = this->next_read_count(size);
 
         if (!this->reader)
         {
-            auto chunk = std::max(0l, static_cast<ssize_t>(this->chunk) - 100l);
-            auto address = reinterpret_cast<size_t>(this->memory + (this->processedCount - this->chunk));
-            if (address % 4096 != 0)
+            // free the consumed chunk, only whole pages inside the chunk are released, because the memory
+            // around it may still be used by other merge ranges
+            auto* consumed = this->memory + (this->processedCount - this->chunk) * this->recordSize;
+            auto start = reinterpret_cast<size_t>(consumed);
+            auto end = reinterpret_cast<size_t>(consumed + this->chunk * this->recordSize);
+            start = (start + 4095) & ~static_cast<size_t>(4095);
+            end &= ~static_cast<size_t>(4095);
+            if (start < end)
             {
-                address -= address % 4096;
+                CHECK_NEG_ERROR(madvise((void*) start, end - start, MADV_FREE));
             }
-            CHECK_NEG_ERROR(madvise((void*) address, chunk * TUPLE_SIZE, MADV_FREE));
 
             if (!left) return 0;
 
@@ -99,32 +122,259 @@ struct ReadBuffer: public Buffer {
         if (left)
         {
             Timer timerRead;
-            this->reader->read_at(this->memory, left, this->fileOffset + this->processedCount);
-            this->reader->dontneed(left, this->fileOffset + this->processedCount);
+            this->directHead = this->read_into(this->data.get(), left, this->read_offset());
+            this->memory = this->data.get() + this->directHead;
             this->processedCount += left;
             this->size = left;
             this->offset = 0;
             bufferIORead += timerRead.get();
         }
-        else this->data.deallocate();
+        else this->release();
+
+        return left;
+    }
+
+    // reads `count` records at the given position of the source into target and returns the offset of the first
+    // record in target (direct reads start at the block of the first record)
+    size_t read_into(uint8_t* target, size_t count, size_t position)
+    {
+        if (this->index)
+        {
+            this->decode_into(target, count, position);
+            return 0;
+        }
+        if (this->direct())
+        {
+            auto read = this->plan_direct_read(count, position);
+            this->reader->read_direct(target, read.directSize, read.offset);
+            if (read.tailSize)
+            {
+                this->reader->read_bytes_at(target + read.directSize, read.tailSize, read.offset + read.directSize);
+            }
+            return read.head;
+        }
+        this->reader->read_at(target, count, position);
+        this->reader->dontneed(count, position);
+        return 0;
+    }
+
+    void release()
+    {
+        for (auto* buffer: { &this->data, &this->spare, &this->packed })
+        {
+            if (buffer->get())
+            {
+                buffer->deallocate();
+            }
+        }
+    }
+
+    // reads `count` records from the blocks of a compressed run, the last read block is kept for the next call
+    void decode_into(uint8_t* target, size_t count, size_t position)
+    {
+        auto& index = *this->index;
+        if (!this->packed.get())
+        {
+            this->packed.allocate(index.max_block_bytes());
+        }
+
+        size_t decoded = 0;
+        while (decoded < count)
+        {
+            size_t block = position / RUN_BLOCK_RECORDS;
+            size_t skip = position % RUN_BLOCK_RECORDS;
+            size_t blockCount = std::min(index.block_count(block) - skip, count - decoded);
+            if (block != this->packedBlock)
+            {
+                this->reader->read_at(this->packed.get(), index.block_bytes(block), index.offsets[block]);
+                this->reader->dontneed(index.block_bytes(block), index.offsets[block]);
+                this->packedBlock = block;
+            }
+            decode_block(index, block, this->packed.get(), skip, blockCount, target + decoded * this->recordSize);
+            decoded += blockCount;
+            position += blockCount;
+        }
+    }
 
+    // number of records transferred by the next read_from_source(size)
+    size_t next_read_count(size_t size) const
+    {
+        auto left = std::min(this->left(), size);
+        if (this->reader)
+        {
+            left = std::min(left, this->capacity);
+        }
         return left;
     }
 
-    Record* memory = nullptr;
-    HugePageBuffer<Record> data;
+    // restricts the buffer to the first `count` records of its source
+    // (records that were already read beyond the limit are dropped)
+    void limit(size_t count)
+    {
+        if (this->processedCount > count)
+        {
+            this->size -= std::min(this->size, this->processedCount - count);
+            this->processedCount = count;
+        }
+        this->totalSize = count;
+    }
+
+    // file offset (in records) of the next read from the source file
+    size_t read_offset() const
+    {
+        return this->fileOffset + this->processedCount;
+    }
+
+    bool direct() const
+    {
+        return this->reader && this->reader->is_direct() && !this->index;
+    }
+
+    // direct reads cover the blocks of the next records, only whole blocks inside of the file are read with
+    // O_DIRECT, the partial last block of the file is read through the page cache
+    struct DirectRead {
+        size_t offset;      // in bytes, aligned
+        size_t directSize;
+        size_t tailSize;
+        size_t head;        // offset of the first record in the read data
+    };
+    DirectRead plan_direct_read(size_t count, size_t position) const
+    {
+        const size_t block = DIRECT_IO_ALIGNMENT;
+        size_t start = position * this->recordSize;
+        size_t end = start + count * this->recordSize;
+        size_t fileEnd = this->reader->get_size() / block * block;
+
+        DirectRead read;
+        read.offset = start / block * block;
+        size_t directEnd = std::max(read.offset, std::min((end + block - 1) / block * block, fileEnd));
+        read.directSize = directEnd - read.offset;
+        read.tailSize = end > directEnd ? end - directEnd : 0;
+        read.head = start - read.offset;
+        return read;
+    }
+
+    // updates the buffer after `count` records were read into data by an external IO worker
+    void finish_read(size_t count)
+    {
+        if (!this->direct())
+        {
+            this->reader->dontneed(count, this->read_offset());
+        }
+        this->memory = this->data.get() + this->directHead;
+        this->processedCount += count;
+        this->size = count;
+        this->offset = 0;
+    }
+
+    // double-buffered read-ahead: while the records in data are merged, the IO worker reads the next `refill`
+    // records of the run into spare, take_prefetched() swaps the halves once that read is finished
+    void start_prefetch(size_t refill, SyncQueue<IORequest>& ioQueue)
+    {
+        this->refill = refill;
+        this->prefetchQueue.reset(new SyncQueue<size_t>());
+        this->prefetch(ioQueue);
+    }
+
+    bool prefetching() const
+    {
+        return this->prefetchQueue != nullptr;
+    }
+
+    // issues the read of the next refill into the spare half (nothing if the run was read completely)
+    void prefetch(SyncQueue<IORequest>& ioQueue)
+    {
+        size_t count = std::min(this->left(), this->refill);
+        if (!count) return;
+
+        // the spare half follows the read-ahead size, the front half keeps its size until it becomes the spare
+        size_t spareBytes = this->refill * this->recordSize + (this->direct() ? 2 * DIRECT_IO_ALIGNMENT : 0);
+        if (this->spareCapacity < count)
+        {
+            if (this->spare.get())
+            {
+                this->spare.deallocate();
+            }
+            this->spare.allocate(spareBytes);
+            this->spareCapacity = this->refill;
+        }
+        else if (this->spareCapacity > this->refill)
+        {
+            this->spare.trim(spareBytes);
+            this->spareCapacity = this->refill;
+        }
+        this->prefetchCount = count;
+        this->prefetchOffset = this->read_offset();
+        ioQueue.push(IORequest::prefetch_buffer(count, this->prefetchQueue.get(), this));
+    }
+
+    // reads the issued refill into spare, called by the IO worker
+    void fill_spare()
+    {
+        this->spareHead = this->read_into(this->spare.get(), this->prefetchCount, this->prefetchOffset);
+    }
+
+    // waits for the read-ahead and makes it the front half, returns the number of records in the buffer (0 when
+    // the run is exhausted), stalled is set when the read was not finished yet
+    size_t take_prefetched(bool& stalled)
+    {
+        stalled = false;
+        if (!this->prefetchCount)
+        {
+            this->release();
+            return 0;
+        }
+
+        size_t count;
+        if (!this->prefetchQueue->try_pop(count))
+        {
+            stalled = true;
+            count = this->prefetchQueue->pop();
+        }
+        this->data.swap(this->spare);
+        std::swap(this->capacity, this->spareCapacity);
+        std::swap(this->directHead, this->spareHead);
+        this->memory = this->data.get() + this->directHead;
+        this->processedCount += count;
+        this->size = count;
+        this->offset = 0;
+        this->prefetchCount = 0;
+        return count;
+    }
+
+    uint8_t* memory = nullptr;
+    HugePageBuffer<uint8_t> data;
     MemoryReader* reader = nullptr;
+    const RunIndex* index = nullptr;
+    const RunFences* fences = nullptr;
+    HugePageBuffer<uint8_t> packed;     // encoded block of a compressed run
+    size_t packedBlock = SIZE_MAX;
+    size_t capacity = 0;
     size_t chunk = 0;
+    size_t directHead = 0;
+    size_t recordSize;
+
+    HugePageBuffer<uint8_t> spare;      // back half of the read-ahead
+    size_t spareCapacity = 0;
+    size_t spareHead = 0;
+    size_t refill = 0;                  // records per read-ahead
+    size_t prefetchCount = 0;           // records of the read-ahead in flight
+    size_t prefetchOffset = 0;
+    std::unique_ptr<SyncQueue<size_t>> prefetchQueue;
 };
 
+// in direct mode, the buffers start at a block boundary of the file: the records are preceded by the first
+// lead bytes of their block, which are either the rest of the previous write (carried over from the other buffer)
+// or, at the start of the stream, skip bytes that belong to the data before the stream
+template <typename Record>
 struct WriteBuffer: public Buffer {
-    explicit WriteBuffer(size_t size): Buffer(size)
+    explicit WriteBuffer(size_t size, bool direct = false): Buffer(size), direct(direct)
     {
         for (auto& buffer: this->buffers)
         {
-            buffer.allocate(size);
+            buffer.allocate(size * sizeof(Record) + (direct ? DIRECT_IO_ALIGNMENT : 0));
         }
-        this->activeBuffer = this->buffers[this->bufferIndex].get();
+        this->activeBuffer = reinterpret_cast<Record*>(this->buffers[this->bufferIndex].get());
     }
     DISABLE_COPY(WriteBuffer);
     DISABLE_MOVE(WriteBuffer);
@@ -148,14 +398,14 @@ struct WriteBuffer: public Buffer {
     // returns true if the read buffer is exhausted
     bool transfer_record(ReadBuffer& other, Timer& timer)
     {
-        this->store(other.load());
+        this->store(other.load<Record>());
         this->offset++;
         other.offset++;
 
         if (EXPECT(other.needsFlush(), 0))
         {
             mergeTime += timer.get();
-            auto result = other.read_from_source(MERGE_READ_COUNT);
+            auto result = other.read_from_source(get_config().mergeReadCount);
             timer.reset();
             return result == 0;
         }
@@ -170,10 +420,65 @@ struct WriteBuffer: public Buffer {
     void swapBuffer()
     {
         this->bufferIndex = 1 - this->bufferIndex;
-        this->activeBuffer = this->buffers[this->bufferIndex].get();
+        this->activeBuffer = reinterpret_cast<Record*>(this->buffers[this->bufferIndex].get());
+    }
+
+    // starts a direct stream whose first record is written at the given byte offset of the file
+    void start_direct(size_t byteOffset)
+    {
+        this->blockOffset = byteOffset / DIRECT_IO_ALIGNMENT * DIRECT_IO_ALIGNMENT;
+        this->lead = byteOffset - this->blockOffset;
+        this->skip = this->lead;
+        this->processedCount = 0;
+        this->offset = 0;
+        this->activeBuffer = reinterpret_cast<Record*>(this->buffers[this->bufferIndex].get() + this->lead);
+    }
+
+    // returns the write request (in bytes, for a writer of record size 1 opened with O_DIRECT) of the whole
+    // blocks of the active buffer and switches to the other buffer, whose previous write has to be finished
+    // the partial last block is carried over to the other buffer, unless this is the last write of the stream,
+    // partial blocks at the ends of the stream are written through the page cache
+    IORequest flush_direct(FileWriter& writer, SyncQueue<size_t>* queue, bool last)
+    {
+        const size_t block = DIRECT_IO_ALIGNMENT;
+        auto* data = this->buffers[this->bufferIndex].get();
+        size_t bytes = this->lead + this->offset * sizeof(Record);
+        size_t whole = bytes / block * block;
+
+        size_t start = 0;
+        if (this->skip && (whole || last))
+        {
+            size_t headEnd = std::min(bytes, block);
+            writer.write_unaligned(data + this->skip, headEnd - this->skip, this->blockOffset + this->skip);
+            start = headEnd;
+            this->skip = 0;
+        }
+        size_t end = std::max(start, whole);
+        auto request = IORequest::write(data + start, end - start, this->blockOffset + start, queue, &writer);
+
+        size_t rest = bytes - end;
+        if (last)
+        {
+            writer.write_unaligned(data + end, rest, this->blockOffset + end);
+            rest = 0;
+        }
+
+        this->processedCount += this->offset;
+        this->offset = 0;
+        this->blockOffset += end;
+        this->swapBuffer();
+        std::memcpy(this->buffers[this->bufferIndex].get(), data + end, rest);
+        this->lead = rest;
+        this->activeBuffer = reinterpret_cast<Record*>(this->buffers[this->bufferIndex].get() + this->lead);
+        return request;
     }
 
     Record* activeBuffer;
     size_t bufferIndex = 0;
-    HugePageBuffer<Record> buffers[2];
+    HugePageBuffer<uint8_t> buffers[2];
+
+    bool direct;
+    size_t blockOffset = 0;     // file offset of the active buffer (in bytes)
+    size_t lead = 0;            // bytes in front of the first record of the active buffer
+    size_t skip = 0;            // bytes at the start of the first block that are not written by this stream
 };
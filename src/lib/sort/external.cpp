@@ -13,6 +13,10 @@
 #include "../sync.h"
 #include "../io/worker.h"
 #include "../memory.h"
+#include "../config.h"
+#include "../numa.h"
+#include "../gather.h"
+#include "run-format.h"
 
 #include <vector>
 #include <queue>
@@ -25,13 +29,13 @@ static std::vector<OverlapRange> createOverlapRanges(size_t count)
 {
     std::vector<OverlapRange> overlapRanges;
 
-    size_t inmemory = std::min(count, static_cast<size_t>(EXTERNAL_SORT_INMEMORY_COUNT));
+    size_t inmemory = std::min(count, get_config().externalInmemoryCount);
     size_t disk = count - inmemory;
 
     size_t offset = 0;
     while (offset < disk)
     {
-        size_t partialCount = std::min(disk - offset, static_cast<size_t>(EXTERNAL_SORT_PARTIAL_COUNT));
+        size_t partialCount = std::min(disk - offset, get_config().externalPartialCount);
         overlapRanges.emplace_back(offset, offset + partialCount, 0, false );
         offset += partialCount;
     }
@@ -41,38 +45,98 @@ static std::vector<OverlapRange> createOverlapRanges(size_t count)
     return overlapRanges;
 }
 
+template <typename Record>
 void sort_external(const std::string& infile, size_t size, const std::string& outfile, size_t threads)
 {
     Timer externalInit;
-    size_t count = size / TUPLE_SIZE;
+    size_t count = size / sizeof(Record);
     std::vector<FileRecord> files;
     std::vector<OverlapRange> overlapRanges = createOverlapRanges(count);
 
     SyncQueue<IORequest> ioQueue;
     SyncQueue<size_t> notifyQueue;
-    MemoryReader reader(infile.c_str());
+    MemoryReader reader(infile.c_str(), sizeof(Record));
 
     std::thread ioThread = ioWorker(ioQueue);
 
-    auto offsetSize = std::max(EXTERNAL_SORT_PARTIAL_COUNT, EXTERNAL_SORT_INMEMORY_COUNT);
-    auto bufferSize = 2 * offsetSize;
-    HugePageBuffer<Record> buffer(bufferSize);
+    auto offsetSize = std::max(get_config().externalPartialCount, get_config().externalInmemoryCount);
+    // run generation is a pipeline: while part r + 1 is read into one input chunk and part r is sorted in the
+    // other one, the sorted part r - 1 is written from the output chunk
+    HugePageBuffer<Record> inputs[2] = { HugePageBuffer<Record>(offsetSize), HugePageBuffer<Record>(offsetSize) };
+    HugePageBuffer<Record> output(offsetSize);
     Record* buffers[2] = {
-            buffer.get(),
-            buffer.get() + offsetSize
+            inputs[0].get(),
+            inputs[1].get()
     };
-    size_t activeBuffer = overlapRanges.size() % 2;
+    for (auto* part: { buffers[0], buffers[1], output.get() })
+    {
+        numa_distribute(part, offsetSize * sizeof(Record));
+    }
+    size_t activeBuffer = 0;
 
     std::vector<MemoryReader> readers;
     std::vector<ReadBuffer> readBuffers;
-    readBuffers.reserve(files.size() + 1);
+
+    // if there are too many runs to merge them at once, intermediate merge passes are needed
+    // and the runs cannot be prefetched during run generation
+    size_t fanIn = merge_fan_in(get_config().mergeMemoryLimit, threads);
+    size_t maxRuns = fanIn - 1; // one input of the final merge is the in-memory part
+    bool cascade = overlapRanges.size() - 1 > maxRuns;
+    readers.reserve(overlapRanges.size());
+    readBuffers.reserve(overlapRanges.size());
+
+    // the run in flight (the last one in files) gets its reader once it was written
+    SyncQueue<size_t> writeNotify;
+    std::unique_ptr<FileWriter> runWriter;
+    auto start_write = [&](size_t count) {
+        bool direct = get_config().directIO;
+        size_t bytes = count * sizeof(Record);
+        runWriter.reset(new FileWriter(files.back().name.c_str(), 1, direct));
+        runWriter->preallocate(bytes);
+
+        // direct writes end at a block boundary, the partial last block is written through the page cache
+        size_t whole = direct ? bytes / DIRECT_IO_ALIGNMENT * DIRECT_IO_ALIGNMENT : bytes;
+        auto* data = reinterpret_cast<uint8_t*>(output.get());
+        runWriter->write_unaligned(data + whole, bytes - whole, whole);
+        ioQueue.push(IORequest::write(data, whole, 0, &writeNotify, runWriter.get()));
+    };
+    auto finish_write = [&]() {
+        if (!runWriter) return;
+
+        Timer timerWait;
+        writeNotify.pop();
+        runWriter.reset();
+        readers.emplace_back(files.back().name.c_str(), sizeof(Record), get_config().directIO);
+        timerWait.print("Wait for write");
+    };
+    // merge buffers of the runs that have a reader, their first records are read while the last part is sorted
+    // the buffers only take the memory of the idle input chunk, the other runs get theirs after run generation
+    size_t prefetchMemory = 0;
+    size_t bufferMemory = arena_footprint(get_config().mergeReadBufferCount() * sizeof(Record) +
+                                          (get_config().directIO ? 2 * DIRECT_IO_ALIGNMENT : 0));
+    auto prefetch_runs = [&]() {
+        for (size_t i = readBuffers.size(); i < readers.size() && prefetchMemory >= bufferMemory; i++)
+        {
+            prefetchMemory -= bufferMemory;
+            readBuffers.emplace_back(
+                    get_config().mergeReadBufferCount(),
+                    static_cast<size_t>(0),
+                    files[i].count,
+                    &readers[i],
+                    files[i].index.get(),
+                    files[i].fences.get()
+            );
+            ioQueue.push(IORequest::read_buffer(get_config().mergeInitialReadCount, &notifyQueue,
+                                                &readBuffers.back()));
+        }
+    };
 
     {
         ioQueue.push(IORequest::read(buffers[activeBuffer], overlapRanges[0].count(), overlapRanges[0].start,
                 &notifyQueue, &reader));
 
-        auto sortBuffer = std::unique_ptr<SortRecord[]>(new SortRecord[offsetSize]);
-        auto targets = std::unique_ptr<GroupTarget[]>(new GroupTarget[offsetSize]);
+        HugePageBuffer<SortRecord<Record>> sortBuffer(offsetSize);
+        numa_distribute(sortBuffer.get(), offsetSize * sizeof(SortRecord<Record>));
 
         for (size_t r = 0; r < overlapRanges.size(); r++)
         {
@@ -89,37 +153,29 @@ void sort_external(const std::string& infile, size_t size, const std::string& ou
             }
             else
             {
-                for (size_t i = 0; i < files.size(); i++)
-                {
-                    readBuffers.emplace_back(
-                            static_cast<size_t>(MERGE_READ_BUFFER_COUNT),
-                            static_cast<size_t>(0),
-                            files[i].count,
-                            &readers[i]
-                    );
-                }
-                for (auto& buffer: readBuffers)
-                {
-                    ioQueue.push(IORequest::read_buffer(MERGE_INITIAL_READ_COUNT, &notifyQueue, &buffer));
-                }
+                // nothing is read into the other input chunk anymore
+                inputs[1 - activeBuffer].deallocate();
+                prefetchMemory = arena_footprint(offsetSize * sizeof(Record));
+                if (!cascade) prefetch_runs();
             }
 
-            std::string out = WRITE_LOCATION + "/out-" + std::to_string(files.size());
+            std::string out = get_config().writeLocation + "/out-" + std::to_string(files.size());
 
             Timer timer;
-            sort_records(buffers[activeBuffer], sortBuffer.get(), targets.get(), range.count(), threads);
+            sort_records(buffers[activeBuffer], sortBuffer.get(), range.count(), threads);
             timer.print("Sort file");
 
+            // the output chunk is free once the previous run was written
+            finish_write();
+            if (lastPart && !cascade)
+            {
+                prefetch_runs();
+            }
+
             if (range.memory)
             {
                 Timer timerPartCopy;
-                auto* __restrict__ source = buffers[activeBuffer];
-                auto* __restrict__ target = buffers[1 - activeBuffer];
-#pragma omp parallel for num_threads(threads)
-                for (size_t i = 0; i < range.count(); i++)
-                {
-                    target[i] = source[sortBuffer.get()[i].index];
-                }
+                gather_records_parallel(output.get(), buffers[activeBuffer], sortBuffer.get(), range.count(), threads);
                 timerPartCopy.print("Last part copy");
             }
             else
@@ -127,43 +183,103 @@ void sort_external(const std::string& infile, size_t size, const std::string& ou
                 std::cerr << "Writing " << range.count() << " records to " << out << std::endl;
 
                 Timer timerWrite;
-                write_sequential_io(buffers[activeBuffer], sortBuffer.get(), range.count(), out, WRITE_BUFFER_COUNT,
-                        threads);
+                if (get_config().runCompression)
+                {
+                    auto index = write_compressed_run(buffers[activeBuffer], sortBuffer.get(), range.count(), out,
+                            get_config().writeBufferCount, threads);
+                    std::cerr << "Compressed run: " << index->offsets.back() << " bytes ("
+                              << range.count() * sizeof(Record) << " raw)" << std::endl;
+                    files.push_back(FileRecord{out, range.count(), index});
+                    readers.emplace_back(out.c_str(), 1);
+                }
+                else
+                {
+                    // the run is written in the background while the next part is sorted
+                    gather_records_parallel(output.get(), buffers[activeBuffer], sortBuffer.get(), range.count(),
+                                            threads);
+                    auto fences = std::make_shared<RunFences>(Record::KEY_SIZE, range.count());
+                    fences->add(output.get(), 0, range.count());
+                    files.push_back(FileRecord{out, range.count(), nullptr, fences});
+                    start_write(range.count());
+                }
                 timerWrite.print("Write");
-
-                files.push_back(FileRecord{out, range.count()});
-                readers.emplace_back(out.c_str());
             }
             activeBuffer = 1 - activeBuffer;
         }
+        finish_write();
     }
     Timer timerWait;
     ioQueue.push(IORequest::last());
     ioThread.join();
     timerWait.print("Wait for read");
 
-    // active buffer contains the last merge part here
-    // free up the second half of the buffer
-    buffer.trim(EXTERNAL_SORT_INMEMORY_COUNT);
+    // the output chunk contains the last merge part here, the input chunks are not needed anymore
+    for (auto& input: inputs)
+    {
+        if (input.get()) input.deallocate();
+    }
+    output.trim(get_config().externalInmemoryCount);
+
+    if (!cascade)
+    {
+        size_t prefetched = readBuffers.size();
+        for (size_t i = prefetched; i < readers.size(); i++)
+        {
+            readBuffers.emplace_back(get_config().mergeReadBufferCount(), static_cast<size_t>(0), files[i].count,
+                                     &readers[i], files[i].index.get(), files[i].fences.get());
+        }
+#pragma omp parallel for num_threads(threads)
+        for (size_t i = prefetched; i < readBuffers.size(); i++)
+        {
+            readBuffers[i].read_from_source(get_config().mergeInitialReadCount);
+        }
+    }
 
     externalInit.print("External init");
 
-    readBuffers.emplace_back(buffers[activeBuffer], overlapRanges[overlapRanges.size() - 1].count());
+    if (cascade)
+    {
+        Timer timerCascade;
+        files = merge_cascade<Record>(files, maxRuns, fanIn, threads);
+        readers.clear();
+        for (auto& file: files)
+        {
+            if (file.index) readers.emplace_back(file.name.c_str(), 1);
+            else readers.emplace_back(file.name.c_str(), sizeof(Record), get_config().directIO);
+            readBuffers.emplace_back(
+                    get_config().mergeReadBufferCount(),
+                    static_cast<size_t>(0),
+                    file.count,
+                    &readers.back(),
+                    file.index.get(),
+                    file.fences.get()
+            );
+        }
+#pragma omp parallel for num_threads(threads)
+        for (size_t i = 0; i < readBuffers.size(); i++)
+        {
+            readBuffers[i].read_from_source(get_config().mergeInitialReadCount);
+        }
+        timerCascade.print("Intermediate merges");
+    }
+
+    readBuffers.emplace_back(output.get(), overlapRanges[overlapRanges.size() - 1].count());
 
     Timer timer;
-    merge_files(files, readers, readBuffers, outfile, size, threads);
+    merge_files<Record>(files, readers, readBuffers, outfile, size, threads);
     timer.print("Merge files");
 }
+template <typename Record>
 void sort_external_records(const std::string& infile, size_t size, const std::string& outfile, size_t threads)
 {
 #define BUFFER_SIZE 50000000
 
-    ssize_t count = size / TUPLE_SIZE;
-    auto sortedIndices = std::unique_ptr<uint32_t[]>(new uint32_t[count]);
+    ssize_t count = size / sizeof(Record);
+    HugePageBuffer<uint32_t> sortedIndices(count);
     {
-        auto sortBuffer = std::unique_ptr<SortRecord[]>(new SortRecord[count]);
-        auto buffer = std::unique_ptr<Record[]>(new Record[BUFFER_SIZE]);
-        MemoryReader reader(infile.c_str());
+        HugePageBuffer<SortRecord<Record>> sortBuffer(count);
+        HugePageBuffer<Record> buffer(BUFFER_SIZE);
+        MemoryReader reader(infile.c_str(), sizeof(Record));
 
         auto chunks = std::ceil(count / (double) BUFFER_SIZE);
         auto offset = 0;
@@ -178,7 +294,7 @@ void sort_external_records(const std::string& infile, size_t size, const std::st
             for (ssize_t j = 0; j < length; j++)
             {
                 auto& sortRecord = sortBuffer.get()[offset + j];
-                sortRecord.header = get_header(buffer.get()[j]);
+                sortRecord.set_key(get_header(buffer.get()[j]));
                 sortRecord.index = offset + j;
             }
             offset += length;
@@ -186,7 +302,7 @@ void sort_external_records(const std::string& infile, size_t size, const std::st
         timerRead.print("Read");
 
         Timer timerSort;
-        auto sortedOutput = std::unique_ptr<SortRecord[]>(new SortRecord[count]);
+        HugePageBuffer<SortRecord<Record>> sortedOutput(count);
         sort_records_direct(sortBuffer.get(), sortedOutput.get(), count, threads);
         timerSort.print("Sort");
 
@@ -194,20 +310,20 @@ void sort_external_records(const std::string& infile, size_t size, const std::st
 #pragma omp parallel for num_threads(threads)
         for (ssize_t i = 0; i < count; i++)
         {
-            sortedIndices[i] = sortedOutput[i].index;
+            sortedIndices.get()[i] = sortedOutput.get()[i].index;
         }
         timerCompress.print("Compress");
     }
 
 #define OUT_BUFFER_SIZE 1024
-    FileWriter writer(outfile.c_str());
-    MmapReader mmapReader(infile.c_str());
+    FileWriter writer(outfile.c_str(), sizeof(Record));
+    MmapReader<Record> mmapReader(infile.c_str());
     auto* __restrict__ source = mmapReader.get_data();
 
     struct iovec vectors[OUT_BUFFER_SIZE];
     for (auto& vector: vectors)
     {
-        vector.iov_len = 100;
+        vector.iov_len = sizeof(Record);
     }
 
     ssize_t bufferOffset = 0;
@@ -219,7 +335,7 @@ void sort_external_records(const std::string& infile, size_t size, const std::st
 
         for (ssize_t i = 0; i < length; i++)
         {
-            vectors[i].iov_base = (void*) (source + sortedIndices[bufferOffset + i]);
+            vectors[i].iov_base = (void*) (source + sortedIndices.get()[bufferOffset + i]);
         }
 
         Timer timerWrite;
@@ -230,3 +346,9 @@ void sort_external_records(const std::string& infile, size_t size, const std::st
     }
     timerFinal.print("Final write");
 }
+
+#define INSTANTIATE(SIZE, OFFSET, KEY)\
+template void sort_external<FixedRecord<SIZE, OFFSET, KEY>>(const std::string&, size_t, const std::string&, size_t);\
+template void sort_external_records<FixedRecord<SIZE, OFFSET, KEY>>(const std::string&, size_t, const std::string&,\
+        size_t);
+FOR_EACH_RECORD_LAYOUT(INSTANTIATE)
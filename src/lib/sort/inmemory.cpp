@@ -6,11 +6,17 @@
 #include "../../settings.h"
 #include "../io/memory-reader.h"
 #include "../io/mmap-writer.h"
+#include "../io/file-writer.h"
+#include "../io/worker.h"
 #include "../sync.h"
 #include "../compare.h"
 #include "merge.h"
 #include "../memory.h"
+#include "../numa.h"
+#include "../gather.h"
+#include "../config.h"
 
+#include <array>
 #include <memory>
 #include <vector>
 #include <cmath>
@@ -19,13 +25,15 @@
 #include <sys/uio.h>
 #include <x86intrin.h>
 
+template <typename Record>
 void sort_inmemory(const std::string& infile, size_t size, const std::string& outfile, size_t threads)
 {
-    ssize_t count = size / TUPLE_SIZE;
+    ssize_t count = size / sizeof(Record);
 
     HugePageBuffer<Record> buffer(count);
+    numa_distribute(buffer.get(), count * sizeof(Record));
     Timer timerLoad;
-    MemoryReader reader(infile.c_str());
+    MemoryReader reader(infile.c_str(), sizeof(Record));
 
     size_t readThreads = 4;
     size_t perThread = std::ceil(count / readThreads);
@@ -37,46 +45,117 @@ void sort_inmemory(const std::string& infile, size_t size, const std::string& ou
     }
     timerLoad.print("Read");
 
-    HugePageBuffer<uint32_t> indices(count);
+    HugePageBuffer<SortRecord<Record>> output(count);
+    numa_distribute(output.get(), count * sizeof(SortRecord<Record>));
+
+    Timer timerSort;
+    sort_records(buffer.get(), output.get(), count, threads);
+    timerSort.print("Sort");
+
+    Timer timerWrite;
+    write_mmap(buffer.get(), output.get(), static_cast<size_t>(count), outfile, threads);
+//    write_buffered(buffer.get(), output.get(), static_cast<size_t>(count), outfile, WRITE_BUFFER_COUNT, threads);
+//    write_sequential_io(buffer.get(), output.get(), static_cast<size_t>(count), outfile, WRITE_BUFFER_COUNT, threads);
+    timerWrite.print("Write");
+}
+
+// Only the input and its sort keys are kept in memory: the sorted order is applied to the input buffer in place
+// and the buffer is then written to the output sequentially.
+template <typename Record>
+void sort_inmemory_inplace(const std::string& infile, size_t size, const std::string& outfile, size_t threads)
+{
+    ssize_t count = size / sizeof(Record);
+
+    HugePageBuffer<Record> buffer(count);
+    numa_distribute(buffer.get(), count * sizeof(Record));
+    Timer timerLoad;
+    MemoryReader reader(infile.c_str(), sizeof(Record));
+
+    size_t readThreads = 4;
+#pragma omp parallel num_threads(readThreads)
+    {
+        auto thread = static_cast<size_t>(omp_get_thread_num());
+        size_t start = count * thread / readThreads;
+        size_t end = count * (thread + 1) / readThreads;
+        reader.read_at(buffer.get() + start, end - start, start);
+    }
+    timerLoad.print("Read");
+
     {
-        HugePageBuffer<SortRecord> output(count);
-        HugePageBuffer<GroupTarget> targets(count);
+        HugePageBuffer<SortRecord<Record>> output(count);
+        numa_distribute(output.get(), count * sizeof(SortRecord<Record>));
 
         Timer timerSort;
-        sort_records(buffer.get(), output.get(), targets.get(), count, threads);
+        sort_records(buffer.get(), output.get(), count, threads);
         timerSort.print("Sort");
 
-#pragma omp parallel for num_threads(threads)
-        for (ssize_t i = 0; i < count; i++)
-        {
-            indices.get()[i] = output.get()[i].index;
-        }
+        Timer timerPermute;
+        permute_records_inplace(buffer.get(), output.get(), count, threads);
+        timerPermute.print("Permute");
     }
 
     Timer timerWrite;
-    write_mmap(buffer.get(), indices.get(), static_cast<size_t>(count), outfile, threads);
-//    write_buffered(buffer.get(), output.get(), static_cast<size_t>(count), outfile, WRITE_BUFFER_COUNT, threads);
-//    write_sequential_io(buffer.get(), output.get(), static_cast<size_t>(count), outfile, WRITE_BUFFER_COUNT, threads);
+    FileWriter writer(outfile.c_str(), sizeof(Record));
+    writer.preallocate(count);
+    SyncQueue<IORequest> ioQueue;
+    SyncQueue<size_t> notifyQueue;
+    std::thread ioThread = ioWorker(ioQueue);
+    ioQueue.push(IORequest::write(buffer.get(), count, 0, &notifyQueue, &writer));
+    notifyQueue.pop();
+    ioQueue.push(IORequest::last());
+    ioThread.join();
     timerWrite.print("Write");
 }
 
+template <typename Record>
 static void merge_inmemory(
         const Record* __restrict__ data,
         Record* __restrict__ target,
-        const std::unique_ptr<SortRecord[]>* parts,
+        const HugePageBuffer<SortRecord<Record>>* parts,
         const MergeRange& mergeRange,
         std::vector<OverlapRange> ranges,
-        const std::string& outfile)
+        const std::string& outfile,
+        NumaTraffic* traffic)
 {
+    // every part was distributed over the nodes separately, ranges are reused as merge cursors below
+    std::vector<size_t> partBytes;
+    for (auto& range: ranges)
+    {
+        partBytes.push_back(range.count() * sizeof(Record));
+    }
+    auto nodes = numa_topology().nodes();
+    auto node = numa_current_node();
+    size_t remote = 0;
+
     auto cmp = [&parts, &ranges](short lhs, short rhs) {
-        return !cmp_header(
-                parts[lhs].get()[ranges[lhs].offset].header,
-                parts[rhs].get()[ranges[rhs].offset].header
-        );
+        return !(parts[lhs].get()[ranges[lhs].offset] < parts[rhs].get()[ranges[rhs].offset]);
     };
 
     target += mergeRange.writeStart;
 
+    // the merged order is collected in blocks of record indices that are gathered at once, so that the records
+    // can be prefetched (or read window by window with the blocked permutation)
+    bool blocked = get_config().blockedPermutation;
+    size_t dataCount = ranges.back().end;
+    size_t pendingCount = blocked ? std::max(static_cast<size_t>(1), static_cast<size_t>(PERMUTE_BLOCK_SIZE /
+                                                                                          sizeof(Record)))
+                                  : static_cast<size_t>(GATHER_BLOCK_RECORDS);
+    std::vector<size_t> pending;
+    pending.reserve(pendingCount);
+    auto flush = [&]() {
+        if (blocked) gather_records_blocked(target, data, pending.data(), pending.size(), dataCount);
+        else gather_records(target, data, pending.data(), pending.size());
+        target += pending.size();
+        pending.clear();
+    };
+    auto emit = [&](size_t index) {
+        pending.push_back(index);
+        if (pending.size() == pendingCount)
+        {
+            flush();
+        }
+    };
+
     std::priority_queue<short, std::vector<short>, decltype(cmp)> heap(cmp);
 
     for (size_t i = 0; i < ranges.size(); i++)
@@ -102,7 +181,9 @@ static void merge_inmemory(
         auto offset = range.offset;
         range.offset++;
 
-        *target++ = data[parts[source].get()[offset].index + range.start];
+        auto index = parts[source].get()[offset].index;
+        if (traffic) remote += numa_distributed_node(index * sizeof(Record), partBytes[source], nodes) != node;
+        emit(index + range.start);
 
         if (range.offset < range.end)
         {
@@ -116,16 +197,30 @@ static void merge_inmemory(
 
     while (range.offset < range.end)
     {
-        *target++ = data[readPtr[range.offset++].index + range.start];
+        auto index = readPtr[range.offset++].index;
+        if (traffic) remote += numa_distributed_node(index * sizeof(Record), partBytes[source], nodes) != node;
+        emit(index + range.start);
+    }
+    flush();
+
+    if (traffic)
+    {
+        size_t count = 0;
+        for (auto& group: mergeRange.groups)
+        {
+            count += group.count;
+        }
+        traffic->add(count, remote);
     }
 }
 
+template <typename Record>
 void sort_inmemory_overlapped(const std::string& infile, size_t size, const std::string& outfile, size_t threads)
 {
-    ssize_t count = size / TUPLE_SIZE;
+    ssize_t count = size / sizeof(Record);
     HugePageBuffer<Record> buffer(count);
 
-    std::unique_ptr<SortRecord[]> sortedRecords[INMEMORY_OVERLAP_PARTS];
+    HugePageBuffer<SortRecord<Record>> sortedRecords[INMEMORY_OVERLAP_PARTS];
     std::vector<OverlapRange> ranges;
     auto perPart = static_cast<size_t>(std::ceil(count / (double) INMEMORY_OVERLAP_PARTS));
 
@@ -135,18 +230,21 @@ void sort_inmemory_overlapped(const std::string& infile, size_t size, const std:
         auto end = std::max(start, std::min(static_cast<size_t>(count), start + perPart));
         OverlapRange range{ start, end, 0 };
         ranges.push_back(range);
-        sortedRecords[i] = std::unique_ptr<SortRecord[]>(new SortRecord[range.count()]);
+        sortedRecords[i].allocate(range.count());
+        // the part is read by the IO thread, but sorted by all threads
+        numa_distribute(buffer.get() + range.start, range.count() * sizeof(Record));
+        numa_distribute(sortedRecords[i].get(), range.count() * sizeof(SortRecord<Record>));
     }
 
     SyncQueue<OverlapRange> queue;
 
-    MmapWriter<true>* writer;
+    MmapWriter<Record, true>* writer;
     std::thread populateThread([&writer, &outfile, count]() {
-        writer = new MmapWriter<true>(outfile.c_str(), count);
+        writer = new MmapWriter<Record, true>(outfile.c_str(), count);
     });
 
     std::thread readThread([&ranges, &queue, &buffer, &infile]() {
-        MemoryReader reader(infile.c_str());
+        MemoryReader reader(infile.c_str(), sizeof(Record));
 
         for (int i = 0; i < INMEMORY_OVERLAP_PARTS; i++)
         {
@@ -158,18 +256,25 @@ void sort_inmemory_overlapped(const std::string& infile, size_t size, const std:
         }
     });
 
-    std::vector<MergeRange> mergeRanges(SORT_GROUP_COUNT);
+    std::vector<MergeRange> mergeRanges;
     {
-        auto targets = std::unique_ptr<GroupTarget[]>(new GroupTarget[perPart]);
+        GroupLayout<Record> layout;
 
         for (auto& sortedRecord: sortedRecords)
         {
             auto range = queue.pop();
+            if (mergeRanges.empty())
+            {
+                // all parts share the splitters of the first part, so that their groups can be merged
+                layout = sample_group_layout(buffer.get() + range.start, range.count(), threads);
+                mergeRanges.resize(layout.size());
+            }
             Timer timerSort;
-            auto groupData = sort_records(buffer.get() + range.start, sortedRecord.get(), targets.get(), range.count(), threads);
+            auto groupData = sort_records(buffer.get() + range.start, sortedRecord.get(), layout, range.count(),
+                                          threads);
             for (size_t i = 0; i < groupData.size(); i++)
             {
-                mergeRanges[i].groups.push_back(groupData[i]);
+                mergeRanges[i].groups.push_back(MergeGroup{ groupData[i].start, groupData[i].count });
             }
             timerSort.print("Sort");
         }
@@ -184,79 +289,46 @@ void sort_inmemory_overlapped(const std::string& infile, size_t size, const std:
     populateThread.join();
     auto* target = writer->get_data();
 
+    NumaTraffic traffic;
 #pragma omp parallel for num_threads(threads) schedule(dynamic)
     for (size_t i = 0; i < mergeRanges.size(); i++)
     {
-        merge_inmemory(buffer.get(), target, sortedRecords, mergeRanges[i], ranges, outfile);
+        merge_inmemory(buffer.get(), target, sortedRecords, mergeRanges[i], ranges, outfile,
+                       numa_enabled() ? &traffic : nullptr);
     }
 
     delete writer;
 
     timerMerge.print("Merge");
-}
-
-template <typename T, bool HugePages=true>
-struct MemoryRegion {
-    MemoryRegion() = default;
-
-    DISABLE_COPY(MemoryRegion);
-    DISABLE_MOVE(MemoryRegion);
-
-    void alloc(size_t count)
-    {
-        this->address = static_cast<T*>(mmap64(nullptr, count * sizeof(T), PROT_READ | PROT_WRITE,
-                                    MAP_ANONYMOUS | MAP_PRIVATE, -1, 0));
-        CHECK_NEG_ERROR((ssize_t) this->address);
-        if (HugePages)
-        {
-            CHECK_NEG_ERROR(madvise(this->address, count * sizeof(T), MADV_HUGEPAGE));
-        }
-        this->capacity = count;
-    }
-    void realloc(size_t count)
+    if (numa_enabled())
     {
-        this->address = static_cast<T*>(mremap(this->address, this->capacity * sizeof(T), count * sizeof(T),
-                MREMAP_MAYMOVE));
-        CHECK_NEG_ERROR((ssize_t) this->address);
-        if (HugePages)
-        {
-            CHECK_NEG_ERROR(madvise(this->address, count * sizeof(T), MADV_HUGEPAGE));
-        }
-        this->capacity = count;
+        traffic.print("Merge", sizeof(Record));
     }
+}
 
-    bool is_full() const
-    {
-        return this->count == this->capacity;
-    }
-
-    void write(const T& record)
-    {
-        this->address[this->count++] = record;
-    }
-
-    void dealloc()
-    {
-        CHECK_NEG_ERROR(munmap(this->address, this->capacity * sizeof(T)));
-    }
-
-    size_t count = 0;
-    size_t capacity = 0;
-    T* address = nullptr;
-};
-
+// Every read chunk is distributed by the first key byte into its own slice of one contiguous buffer. The read
+// thread reads a chunk in pieces and builds the histogram of every piece while it is still in the cache, so every
+// piece has an exact target position for each bucket and the distribution is a single parallel scatter pass over
+// the pieces, through per-thread write-combining buffers. A bucket consists of one segment per chunk, its sort keys
+// are collected from the segments when the bucket is sorted.
+template <typename Record>
 void sort_inmemory_distribute(const std::string& infile, size_t size, const std::string& outfile, size_t threads)
 {
     Timer timerDistribute;
-    ssize_t count = size / TUPLE_SIZE;
+    ssize_t count = size / sizeof(Record);
+    constexpr size_t BUCKETS = 256;
+    using Histogram = std::array<size_t, BUCKETS>;
 
     std::vector<OverlapRange> ranges;
     auto perPart = static_cast<size_t>(std::ceil(count / (double) INMEMORY_DISTRIBUTE_OVERLAP_PARTS));
-    std::unique_ptr<Record[]> readBuffers[2] = {
-            std::unique_ptr<Record[]>(new Record[perPart]),
-            std::unique_ptr<Record[]>(new Record[perPart])
+    HugePageBuffer<Record> readBuffers[2] = {
+            HugePageBuffer<Record>(perPart),
+            HugePageBuffer<Record>(perPart)
     };
+    // histogram of every piece of the chunk in the read buffer, turned into target positions before the scatter
+    std::vector<Histogram> pieceHistograms[2];
     size_t activeBuffer = 0;
+    const size_t pieceSize = std::max(static_cast<size_t>(1), static_cast<size_t>(INMEMORY_DISTRIBUTE_PIECE_SIZE / sizeof(Record)));
 
     for (int i = 0; i < INMEMORY_DISTRIBUTE_OVERLAP_PARTS; i++)
     {
@@ -266,88 +338,104 @@ void sort_inmemory_distribute(const std::string& infile, size_t size, const std:
         ranges.push_back(range);
     }
 
-    SyncQueue<OverlapRange> queue;
-    SyncQueue<Record*> work;
-
-    size_t ALLOC_SIZE = 4096;
-    size_t REALLOC_SIZE = count / 256;
-
-    MemoryRegion<Record> regions[256];
-    for (auto& region: regions)
-    {
-        region.alloc(ALLOC_SIZE);
-    }
+    HugePageBuffer<Record> records(count);
+    // start of every bucket in the slice of every chunk, bucketStarts[p][BUCKETS] is the end of the slice
+    std::vector<std::array<size_t, BUCKETS + 1>> bucketStarts(INMEMORY_DISTRIBUTE_OVERLAP_PARTS);
 
-    MemoryRegion<SortRecord> recordRegions[256];
-    for (auto& region: recordRegions)
-    {
-        region.alloc(ALLOC_SIZE);
-    }
+    SyncQueue<OverlapRange> queue;
+    SyncQueue<size_t> work;
 
-    std::thread readThread([&ranges, &work, &queue, &infile]() {
-        MemoryReader reader(infile.c_str());
+    std::thread readThread([&ranges, &work, &queue, &infile, &readBuffers, &pieceHistograms, pieceSize]() {
+        MemoryReader reader(infile.c_str(), sizeof(Record));
 
         for (int i = 0; i < INMEMORY_DISTRIBUTE_OVERLAP_PARTS; i++)
         {
-            auto buffer = work.pop();
-            if (buffer == nullptr) break;
-//            Timer timerRead;
-            reader.read(buffer, ranges[i].count());
-//            timerRead.print("Read");
+            auto index = work.pop();
+            auto* buffer = readBuffers[index].get();
+            auto& histograms = pieceHistograms[index];
+            auto rangeCount = ranges[i].count();
+            histograms.assign((rangeCount + pieceSize - 1) / pieceSize, Histogram{});
+
+            for (size_t piece = 0; piece < histograms.size(); piece++)
+            {
+                size_t start = piece * pieceSize;
+                size_t end = std::min(rangeCount, start + pieceSize);
+                reader.read(buffer + start, end - start);
+                auto& histogram = histograms[piece];
+                for (size_t r = start; r < end; r++)
+                {
+                    histogram[get_header(buffer[r])[0]]++;
+                }
+            }
             queue.push(ranges[i]);
         }
     });
 
-    size_t numThreads = 8;
-    work.push(readBuffers[activeBuffer].get());
+    const size_t combineCount = std::max(static_cast<size_t>(1), static_cast<size_t>(INMEMORY_DISTRIBUTE_COMBINE_SIZE / sizeof(Record)));
+    work.push(activeBuffer);
     for (int p = 0; p < INMEMORY_DISTRIBUTE_OVERLAP_PARTS; p++)
     {
         auto range = queue.pop();
         if (p != INMEMORY_DISTRIBUTE_OVERLAP_PARTS - 1)
         {
-            work.push(readBuffers[1 - activeBuffer].get());
+            work.push(1 - activeBuffer);
         }
 
         auto rangeCount = range.count();
-        auto active = readBuffers[activeBuffer].get();
+        auto* __restrict__ active = readBuffers[activeBuffer].get();
+        auto* __restrict__ target = records.get();
+        auto& histograms = pieceHistograms[activeBuffer];
+
+        auto& starts = bucketStarts[p];
+        size_t offset = range.start;
+        for (size_t b = 0; b < BUCKETS; b++)
+        {
+            starts[b] = offset;
+            for (auto& histogram: histograms)
+            {
+                auto bucketCount = histogram[b];
+                histogram[b] = offset;
+                offset += bucketCount;
+            }
+        }
+        starts[BUCKETS] = offset;
 
-//        Timer timerInnerDistribute;
-#pragma omp parallel num_threads(numThreads)
+#pragma omp parallel num_threads(threads)
         {
-            auto id = omp_get_thread_num();
-            size_t perThread = std::ceil(256 / (double) numThreads);
-            size_t start = id * perThread;
-            size_t end = std::min(256ul, start + perThread);
-            if (start < end)
+            HugePageBuffer<Record> combine(BUCKETS * combineCount);
+            auto* __restrict__ buffers = combine.get();
+            std::array<uint32_t, BUCKETS> fill{};
+
+#pragma omp for schedule(dynamic)
+            for (size_t piece = 0; piece < histograms.size(); piece++)
             {
-                for (size_t i = 0; i < rangeCount; i++)
+                auto& positions = histograms[piece];
+                size_t end = std::min(rangeCount, (piece + 1) * pieceSize);
+                for (size_t i = piece * pieceSize; i < end; i++)
+                {
+                    auto bucket = get_header(active[i])[0];
+                    auto* buffer = buffers + bucket * combineCount;
+                    buffer[fill[bucket]++] = active[i];
+                    if (EXPECT(fill[bucket] == combineCount, 0))
+                    {
+                        std::memcpy(target + positions[bucket], buffer, combineCount * sizeof(Record));
+                        positions[bucket] += combineCount;
+                        fill[bucket] = 0;
+                    }
+                }
+                // the target positions of the next piece are different
+                for (size_t bucket = 0; bucket < BUCKETS; bucket++)
                 {
-                    auto value = active[i][0];
-                    if (value >= start && value < end)
+                    if (fill[bucket])
                     {
-                        auto& region = regions[value];
-                        SortRecord record;
-                        record.header = get_header(active[i]);
-                        record.index = region.count;
-
-                        if (EXPECT(region.is_full(), 0))
-                        {
-                            region.realloc(region.capacity + REALLOC_SIZE);
-                        }
-                        region.write(active[i]);
-
-                        auto& recordRegion = recordRegions[value];
-                        if (EXPECT(recordRegion.is_full(), 0))
-                        {
-                            recordRegion.realloc(recordRegion.capacity + REALLOC_SIZE);
-                        }
-
-                        recordRegion.write(record);
+                        std::memcpy(target + positions[bucket], buffers + bucket * combineCount,
+                                    fill[bucket] * sizeof(Record));
+                        positions[bucket] += fill[bucket];
+                        fill[bucket] = 0;
                     }
                 }
             }
         }
-//        timerInnerDistribute.print("Distribute inner");
 
         activeBuffer = 1 - activeBuffer;
     }
@@ -355,55 +443,56 @@ void sort_inmemory_distribute(const std::string& infile, size_t size, const std:
 
     for (auto& buffer: readBuffers)
     {
-        buffer.reset();
+        buffer.deallocate();
     }
 
     timerDistribute.print("Distribute");
 
-    std::vector<uint32_t> offsets;
-    offsets.push_back(0);
-
-    for (auto& region: regions)
+    std::vector<size_t> offsets(BUCKETS + 1, 0);
+    for (size_t b = 0; b < BUCKETS; b++)
     {
-        offsets.push_back(offsets[offsets.size() - 1] + region.count);
+        size_t bucketCount = 0;
+        for (auto& starts: bucketStarts)
+        {
+            bucketCount += starts[b + 1] - starts[b];
+        }
+        offsets[b + 1] = offsets[b] + bucketCount;
     }
 
-    MmapWriter<false> writer(outfile.c_str(), count);
+    MmapWriter<Record, false> writer(outfile.c_str(), count);
     auto* __restrict__ target = writer.get_data();
-
-    SyncQueue<std::pair<void*, size_t>> unmapQueue;
-
-    std::thread unmapThread([&unmapQueue]() {
-        while (true)
-        {
-            auto job = unmapQueue.pop();
-            if (job.first == nullptr) break;
-            CHECK_NEG_ERROR(munmap(job.first, job.second));
-        }
-    });
+    auto* __restrict__ source = records.get();
 
     Timer timerSort;
-#pragma omp parallel for num_threads(8) schedule(dynamic)
-    for (size_t i = 0; i < 256; i++)
+#pragma omp parallel for num_threads(threads) schedule(dynamic)
+    for (size_t i = 0; i < BUCKETS; i++)
     {
-        if (recordRegions[i].count)
-        {
-            msd_radix_sort(recordRegions[i].address, recordRegions[i].count);
+        size_t bucketCount = offsets[i + 1] - offsets[i];
+        if (!bucketCount) continue;
 
-            auto* __restrict__ writeTarget = target + offsets[i];
-            SortRecord* src = recordRegions[i].address;
-#pragma omp parallel for num_threads(5)
-            for (ssize_t j = 0; j < static_cast<ssize_t>(recordRegions[i].count); j++)
+        HugePageBuffer<SortRecord<Record>> sortRecords(bucketCount);
+        auto* keys = sortRecords.get();
+        for (auto& starts: bucketStarts)
+        {
+            for (size_t j = starts[i]; j < starts[i + 1]; j++)
             {
-                writeTarget[j] = regions[i].address[src[j].index];
+                *keys++ = SortRecord<Record>(get_header(source[j]), static_cast<uint32_t>(j));
             }
         }
+        msd_radix_sort(sortRecords.get(), bucketCount);
 
-        unmapQueue.push({ regions[i].address, regions[i].capacity * sizeof(Record) });
-        unmapQueue.push({ recordRegions[i].address, recordRegions[i].capacity * sizeof(SortRecord) });
+        gather_records(target + offsets[i], source, sortRecords.get(), bucketCount);
+        writer.release(offsets[i], bucketCount);
     }
     timerSort.print("Sort");
-
-    unmapQueue.push({ nullptr, 0 });
-    unmapThread.join();
 }
+
+#define INSTANTIATE(SIZE, OFFSET, KEY)\
+template void sort_inmemory<FixedRecord<SIZE, OFFSET, KEY>>(const std::string&, size_t, const std::string&, size_t);\
+template void sort_inmemory_overlapped<FixedRecord<SIZE, OFFSET, KEY>>(const std::string&, size_t,\
+        const std::string&, size_t);\
+template void sort_inmemory_inplace<FixedRecord<SIZE, OFFSET, KEY>>(const std::string&, size_t,\
+        const std::string&, size_t);\
+template void sort_inmemory_distribute<FixedRecord<SIZE, OFFSET, KEY>>(const std::string&, size_t,\
+        const std::string&, size_t);
+FOR_EACH_RECORD_LAYOUT(INSTANTIATE)
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <vector>
+
+#include "../record.h"
+#include "../compare.h"
+
+// tournament tree of losers used for k-way merging
+// each output record costs log2(k) comparisons of cached key prefixes instead of k full record comparisons
+template <size_t KeySize>
+class LoserTree {
+public:
+    using Header = std::array<uint8_t, KeySize>;
+    using Key = MergeKey<KeySize>;
+
+    explicit LoserTree(size_t count)
+    {
+        this->leaves = 1;
+        while (this->leaves < count) this->leaves *= 2;
+
+        this->keys.resize(this->leaves, Key::exhausted());
+        this->tree.resize(this->leaves);
+    }
+
+    void set(size_t index, const Header& header)
+    {
+        this->keys[index] = make_merge_key(header);
+    }
+
+    // must be called after all non-empty leaves were set
+    void build()
+    {
+        if (this->leaves == 1)
+        {
+            this->tree[0] = 0;
+            return;
+        }
+
+        std::vector<uint32_t> winners(this->leaves * 2);
+        for (size_t i = 0; i < this->leaves; i++)
+        {
+            winners[this->leaves + i] = static_cast<uint32_t>(i);
+        }
+        for (size_t node = this->leaves - 1; node > 0; node--)
+        {
+            auto left = winners[node * 2];
+            auto right = winners[node * 2 + 1];
+            if (this->keys[right] < this->keys[left])
+            {
+                std::swap(left, right);
+            }
+            winners[node] = left;
+            this->tree[node] = right;
+        }
+        this->tree[0] = winners[1];
+    }
+
+    // index of the run with the smallest key
+    size_t top() const
+    {
+        return this->tree[0];
+    }
+
+    bool empty() const
+    {
+        return this->keys[this->tree[0]].tail == Key::EXHAUSTED;
+    }
+
+    // the winning run advanced to a new record
+    void replace_top(const Header& header)
+    {
+        this->keys[this->tree[0]] = make_merge_key(header);
+        this->replay();
+    }
+
+    // the winning run has no more records
+    void remove_top()
+    {
+        this->keys[this->tree[0]] = Key::exhausted();
+        this->replay();
+    }
+
+private:
+    void replay()
+    {
+        uint32_t winner = this->tree[0];
+        for (size_t node = (winner + this->leaves) / 2; node > 0; node /= 2)
+        {
+            if (this->keys[this->tree[node]] < this->keys[winner])
+            {
+                std::swap(this->tree[node], winner);
+            }
+        }
+        this->tree[0] = winner;
+    }
+
+    size_t leaves;
+    std::vector<Key> keys;
+    std::vector<uint32_t> tree;
+};
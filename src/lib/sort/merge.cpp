@@ -4,6 +4,9 @@
 #include "../io/mmap-reader.h"
 #include "../sync.h"
 #include "../io/worker.h"
+#include "loser-tree.h"
+#include "../config.h"
+#include "run-format.h"
 
 #include <queue>
 #include <atomic>
@@ -14,71 +17,220 @@
 std::atomic<size_t> bufferIORead{0};
 std::atomic<size_t> bufferIOWrite{0};
 std::atomic<size_t> mergeTime{0};
+static std::atomic<size_t> mergeStalls{0};
 
-static uint8_t extract_heap(const std::vector<ReadBuffer>& buffers, const std::vector<uint8_t>& heap)
+// size of the halves that every run of a merge range starts with, when the merge is split into the given number of
+// ranges, the rest of the read memory of the run (up to MERGE_PREFETCH_RESERVE / 10 of it) is the reserve of the range
+static size_t range_refill(size_t ranges)
 {
-    uint8_t smallest = 0;
-    auto size = static_cast<ssize_t>(heap.size());
-    for (ssize_t i = 1; i < size; i++)
+    size_t readSize = std::max(static_cast<size_t>(MERGE_MIN_READ_COUNT), get_config().mergeReadCount / ranges);
+    return std::max(static_cast<size_t>(MERGE_MIN_READ_COUNT) / 2, readSize * (10 - MERGE_PREFETCH_RESERVE) / 20);
+}
+
+// maximum read memory (in records) of a run in a merge range, both halves and the reserve
+static size_t range_read_memory(size_t refill)
+{
+    return refill * 20 / (10 - MERGE_PREFETCH_RESERVE);
+}
+
+// number of records of the output buffer of a merge range
+static size_t range_write_count(size_t ranges)
+{
+    return std::max(static_cast<size_t>(MERGE_MIN_READ_COUNT), get_config().mergeWriteBufferCount / ranges);
+}
+
+// memory (in bytes) of a single run in a merge split into the given number of ranges: the first range reuses the
+// initial (prefetched) buffer of the run and adds a back half, every other range starts with two halves that may
+// grow into the reserve, halves of direct runs are padded to whole blocks, compressed runs are decoded through a
+// block buffer in every range
+static size_t run_merge_memory(size_t ranges)
+{
+    auto& config = get_config();
+    size_t padding = config.directIO ? 2 * DIRECT_IO_ALIGNMENT : 0;
+    size_t refill = range_refill(ranges);
+    size_t half = arena_footprint(refill * config.recordSize + padding);
+    size_t grown = arena_footprint((range_read_memory(refill) - refill) * config.recordSize + padding);
+    size_t memory = arena_footprint(config.mergeReadBufferCount() * config.recordSize + padding) + half +
+                    (ranges - 1) * (half + grown);
+    if (config.runCompression)
     {
-        if (cmp_record(buffers[heap[i]].load(), buffers[heap[smallest]].load()))
+        memory += ranges * arena_footprint(RUN_BLOCK_RECORDS * (config.recordSize + 1));
+    }
+    return memory;
+}
+
+// memory (in bytes) of the double-buffered output of a merge range
+static size_t range_write_memory(size_t ranges)
+{
+    size_t padding = get_config().directIO ? DIRECT_IO_ALIGNMENT : 0;
+    return 2 * arena_footprint(range_write_count(ranges) * get_config().recordSize + padding);
+}
+
+static size_t ranges_fan_in(size_t memoryLimit, size_t ranges)
+{
+    size_t write = ranges * range_write_memory(ranges);
+    return memoryLimit > write ? (memoryLimit - write) / run_merge_memory(ranges) : 0;
+}
+
+namespace {
+    // distributes the read memory of a merge range among its runs read from disk: the read-ahead of a run is sized
+    // by the run's share of the merged records (measured between its refills), so that runs which are drained
+    // faster are read in larger blocks and slowly drained runs give their memory back, a run that the merge had to
+    // wait for at least doubles its read-ahead
+    class ReadAheadManager {
+    public:
+        ReadAheadManager(std::vector<ReadBuffer>& buffers, size_t refill, SyncQueue<IORequest>& ioQueue)
+        : ioQueue(ioQueue), runs(buffers.size())
+        {
+            size_t disk = 0;
+            for (auto& buffer: buffers)
+            {
+                if (buffer.reader && buffer.left()) disk++;
+            }
+            for (size_t i = 0; i < buffers.size(); i++)
+            {
+                auto& buffer = buffers[i];
+                if (!buffer.reader || !buffer.left()) continue;
+
+                buffer.start_prefetch(refill, ioQueue);
+                this->runs[i].share = 1.0 / disk;
+                this->runs[i].memory = buffer.capacity + buffer.spareCapacity;
+                this->used += this->runs[i].memory;
+            }
+            // the initially prefetched buffers of the first range may be larger than its share
+            this->budget = std::max(this->used, disk * range_read_memory(refill));
+        }
+
+        // refills the run at index after its buffer was merged, merged is the number of records merged so far
+        // returns the number of records in the buffer, 0 if the run is exhausted
+        size_t refill(ReadBuffer& buffer, size_t index, size_t merged)
         {
-            smallest = i;
+            if (!buffer.prefetching())
+            {
+                return buffer.read_from_source(get_config().mergeReadCount);
+            }
+
+            auto& run = this->runs[index];
+            size_t consumed = buffer.size;
+            bool stalled;
+            size_t count = buffer.take_prefetched(stalled);
+            if (!count)
+            {
+                this->used -= run.memory;
+                run.memory = 0;
+                return 0;
+            }
+            if (stalled) mergeStalls++;
+
+            if (merged > run.lastMerged)
+            {
+                double observed = std::min(1.0, consumed / static_cast<double>(merged - run.lastMerged));
+                run.share = (run.share + observed) / 2;
+            }
+            run.lastMerged = merged;
+
+            auto target = static_cast<size_t>(run.share * this->budget * (10 - MERGE_PREFETCH_RESERVE) / 20);
+            if (stalled)
+            {
+                target = std::max(target, 2 * buffer.refill);
+            }
+            size_t others = this->used - run.memory;
+            size_t available = this->budget > others + buffer.capacity ? this->budget - others - buffer.capacity : 0;
+            buffer.refill = std::max(static_cast<size_t>(MERGE_MIN_REFILL_COUNT), std::min(target, available));
+            buffer.prefetch(this->ioQueue);
+
+            run.memory = buffer.capacity + buffer.spareCapacity;
+            this->used = others + run.memory;
+            return count;
         }
-    }
 
-    return smallest;
+    private:
+        struct Run {
+            double share = 0;       // smoothed fraction of the merged records taken from the run
+            size_t lastMerged = 0;  // merged records at the last refill
+            size_t memory = 0;      // records of both halves
+        };
+
+        SyncQueue<IORequest>& ioQueue;
+        std::vector<Run> runs;
+        size_t budget = 0;
+        size_t used = 0;
+    };
 }
 
+template <typename Record>
 static void merge_range(std::vector<ReadBuffer>& buffers, size_t totalSize,
-        size_t writeOffset, FileWriter& writer)
+        size_t writeOffset, size_t writeBufferSize, FileWriter& writer, size_t refill, RunFences* fences)
 {
-    std::vector<uint8_t> heap;
+    LoserTree<Record::KEY_SIZE> tree(buffers.size());
     for (size_t i = 0; i < buffers.size(); i++)
     {
         if (buffers[i].totalSize)
         {
-            heap.push_back(i);
+            tree.set(i, get_header(buffers[i].load<Record>()));
         }
     }
+    tree.build();
 
-    WriteBuffer outBuffer(MERGE_WRITE_BUFFER_COUNT);
+    bool direct = get_config().directIO;
+    WriteBuffer<Record> outBuffer(writeBufferSize, direct);
     outBuffer.fileOffset = writeOffset;
+    if (direct)
+    {
+        outBuffer.start_direct(writeOffset * sizeof(Record));
+    }
 
     SyncQueue<IORequest> ioQueue;
     SyncQueue<size_t> notifyQueue;
 
     std::thread ioThread = ioWorker(ioQueue);
 
+    // runs read from disk are read ahead, in-memory runs do not need it
+    ReadAheadManager readAhead(buffers, refill, ioQueue);
+
     Timer timerMerge;
     notifyQueue.push(0);
-    while (!heap.empty())
+    size_t emitted = 0;     // records of the previous output buffers
+    while (!tree.empty())
     {
         ssize_t leftToWrite = std::min(outBuffer.size, totalSize - outBuffer.processedCount);
         for (ssize_t i = 0; i < leftToWrite; i++)
         {
-            auto sourceIndex = extract_heap(buffers, heap);
-            auto& other = buffers[heap[sourceIndex]];
-            outBuffer.store(other.load());
+            auto top = tree.top();
+            auto& other = buffers[top];
+            outBuffer.store(other.template load<Record>());
             outBuffer.offset++;
             other.offset++;
 
             if (EXPECT(other.needsFlush(), 0))
             {
                 mergeTime += timerMerge.get();
-                if (EXPECT(other.read_from_source(MERGE_READ_COUNT) == 0, 0))
+                if (EXPECT(readAhead.refill(other, top, emitted + outBuffer.offset) == 0, 0))
                 {
-                    std::swap(heap[sourceIndex], heap[heap.size() - 1]);
-                    heap.resize(heap.size() - 1);
-                    if (heap.empty()) break;
+                    tree.remove_top();
+                    timerMerge.reset();
+                    if (tree.empty()) break;
+                    continue;
                 }
                 timerMerge.reset();
             }
+            tree.replace_top(get_header(other.template load<Record>()));
         }
 
         mergeTime += timerMerge.get();
         size_t written = notifyQueue.pop();
         timerMerge.reset();
+        if (fences)
+        {
+            fences->add(outBuffer.getActiveBuffer(), writeOffset + emitted, outBuffer.offset);
+        }
+        emitted += outBuffer.offset;
+        if (direct)
+        {
+            // the writer counts bytes, the processed records are counted by the buffer
+            ioQueue.push(outBuffer.flush_direct(writer, &notifyQueue, tree.empty()));
+            continue;
+        }
         outBuffer.processedCount += written;
         ioQueue.push(IORequest::write(outBuffer.getActiveBuffer(), outBuffer.offset, outBuffer.fileOffset + outBuffer.processedCount, &notifyQueue, &writer));
         outBuffer.swapBuffer();
@@ -91,22 +243,340 @@ static void merge_range(std::vector<ReadBuffer>& buffers, size_t totalSize,
     std::cerr << "Merge processing: " << mergeTime << std::endl;
 }
 
+template <typename Record>
+static typename Record::Header read_key(const ReadBuffer& buffer, size_t index)
+{
+    if (!buffer.reader)
+    {
+        return get_header(buffer.records<Record>()[index]);
+    }
+
+    Record record;
+    buffer.reader->read_at(&record, 1, buffer.fileOffset + index);
+    return get_header(record);
+}
+
+// index of the first record in the compressed run that is not smaller than key
+// the block is found by the first keys of the block index, only that block is read
+template <typename Record>
+static size_t find_split_compressed(const ReadBuffer& buffer, const typename Record::Header& key)
+{
+    auto& index = *buffer.index;
+    size_t low = 0;
+    size_t high = index.blocks();
+    while (low < high)
+    {
+        size_t mid = low + (high - low) / 2;
+        if (cmp_header(*reinterpret_cast<const typename Record::Header*>(index.first_key(mid)), key))
+        {
+            low = mid + 1;
+        }
+        else high = mid;
+    }
+    if (low == 0) return 0;
+
+    size_t block = low - 1;
+    std::vector<uint8_t> packed;
+    std::vector<uint8_t> records;
+    read_block(*buffer.reader, index, block, packed, records);
+    auto* begin = reinterpret_cast<const Record*>(records.data());
+    auto* end = begin + index.block_count(block);
+    auto* split = std::lower_bound(begin, end, key, [](const Record& record, const typename Record::Header& key) {
+        return cmp_header(get_header(record), key);
+    });
+    return block * RUN_BLOCK_RECORDS + static_cast<size_t>(split - begin);
+}
+
+// index of the first record in the raw run that is not smaller than key
+// runs that lie completely before or after the key need no IO, otherwise the block of the split is found by the
+// fence keys and only that block is read
+template <typename Record>
+static size_t find_split_fenced(const ReadBuffer& buffer, const typename Record::Header& key)
+{
+    using Header = typename Record::Header;
+    auto& fences = *buffer.fences;
+    if (cmp_header(*reinterpret_cast<const Header*>(fences.max_key()), key)) return buffer.totalSize;
+    if (!cmp_header(*reinterpret_cast<const Header*>(fences.min_key()), key)) return 0;
+
+    size_t low = 0;
+    size_t high = fences.blocks();
+    while (low < high)
+    {
+        size_t mid = low + (high - low) / 2;
+        if (cmp_header(*reinterpret_cast<const Header*>(fences.first_key(mid)), key))
+        {
+            low = mid + 1;
+        }
+        else high = mid;
+    }
+
+    size_t start = (low - 1) * RUN_FENCE_RECORDS;
+    size_t count = std::min(static_cast<size_t>(RUN_FENCE_RECORDS), buffer.totalSize - start);
+    std::vector<Record> records(count);
+    buffer.reader->read_at(records.data(), count, buffer.fileOffset + start);
+    auto split = std::lower_bound(records.begin(), records.end(), key, [](const Record& record, const Header& key) {
+        return cmp_header(get_header(record), key);
+    });
+    return start + static_cast<size_t>(split - records.begin());
+}
+
+// index of the first record in the buffer's source that is not smaller than key
+template <typename Record>
+static size_t find_split(const ReadBuffer& buffer, const typename Record::Header& key)
+{
+    if (buffer.index)
+    {
+        return find_split_compressed<Record>(buffer, key);
+    }
+    if (buffer.fences)
+    {
+        return find_split_fenced<Record>(buffer, key);
+    }
+
+    size_t low = 0;
+    size_t high = buffer.totalSize;
+    while (low < high)
+    {
+        size_t mid = low + (high - low) / 2;
+        if (cmp_header(read_key<Record>(buffer, mid), key))
+        {
+            low = mid + 1;
+        }
+        else high = mid;
+    }
+    return low;
+}
+
+// chooses splitter keys that divide the records of all sources into `parts` ranges of similar size
+template <typename Record>
+static std::vector<typename Record::Header> choose_splitters(const std::vector<ReadBuffer>& buffers, size_t parts)
+{
+    struct Sample {
+        typename Record::Header key;
+        size_t weight;
+    };
+
+    std::vector<Sample> samples;
+    for (auto& buffer: buffers)
+    {
+        if (!buffer.totalSize) continue;
+
+        if (buffer.index)
+        {
+            // the first keys of the blocks are a sample that does not need any IO
+            auto& index = *buffer.index;
+            size_t blockStep = std::max(static_cast<size_t>(1), index.blocks() / MERGE_SPLIT_SAMPLES);
+            for (size_t block = 0; block < index.blocks(); block += blockStep)
+            {
+                samples.push_back(Sample{ *reinterpret_cast<const typename Record::Header*>(index.first_key(block)),
+                                          blockStep * RUN_BLOCK_RECORDS });
+            }
+            continue;
+        }
+        if (buffer.fences)
+        {
+            // so are the fence keys of raw runs
+            auto& fences = *buffer.fences;
+            size_t fenceStep = std::max(static_cast<size_t>(1), fences.blocks() / MERGE_SPLIT_SAMPLES);
+            for (size_t block = 0; block < fences.blocks(); block += fenceStep)
+            {
+                samples.push_back(Sample{ *reinterpret_cast<const typename Record::Header*>(fences.first_key(block)),
+                                          fenceStep * RUN_FENCE_RECORDS });
+            }
+            continue;
+        }
+
+        size_t step = std::max(static_cast<size_t>(1), buffer.totalSize / MERGE_SPLIT_SAMPLES);
+        for (size_t i = step / 2; i < buffer.totalSize; i += step)
+        {
+            samples.push_back(Sample{ read_key<Record>(buffer, i), step });
+        }
+    }
+    std::sort(samples.begin(), samples.end(), [](const Sample& lhs, const Sample& rhs) {
+        return cmp_header(lhs.key, rhs.key);
+    });
+
+    size_t totalWeight = 0;
+    for (auto& sample: samples)
+    {
+        totalWeight += sample.weight;
+    }
+
+    std::vector<typename Record::Header> splitters;
+    size_t weight = 0;
+    size_t index = 0;
+    for (size_t p = 1; p < parts && !samples.empty(); p++)
+    {
+        size_t target = totalWeight * p / parts;
+        while (index < samples.size() - 1 && weight + samples[index].weight <= target)
+        {
+            weight += samples[index].weight;
+            index++;
+        }
+        splitters.push_back(samples[index].key);
+    }
+    return splitters;
+}
+
+template <typename Record>
 void merge_files(std::vector<FileRecord>& files,
         std::vector<MemoryReader>& readers,
         std::vector<ReadBuffer>& buffers,
-        const std::string& outfile, size_t size, size_t threads)
+        const std::string& outfile, size_t size, size_t threads, RunFences* fences)
 {
-    size_t totalSize = size / TUPLE_SIZE;
-
-    FileWriter writer(outfile.c_str());
-    writer.expect_sequential(totalSize, 0);
+    // direct writes are aligned in bytes, not records
+    bool direct = get_config().directIO;
+    size_t unit = direct ? 1 : sizeof(Record);
+    FileWriter writer(outfile.c_str(), unit, direct);
+    writer.preallocate(size / unit);
+    writer.expect_sequential(size / unit, 0);
 
     bufferIORead = 0;
     bufferIOWrite = 0;
-    merge_range(buffers, totalSize, 0, writer);
+    mergeStalls = 0;
+
+    // split the key space into ranges that are merged independently and written to precomputed offsets
+    Timer timerSplit;
+    size_t parts = merge_ranges(get_config().mergeMemoryLimit, threads);
+    auto splitters = choose_splitters<Record>(buffers, parts);
+
+    std::vector<std::vector<size_t>> splits(buffers.size());
+#pragma omp parallel for num_threads(threads) schedule(dynamic)
+    for (size_t i = 0; i < buffers.size(); i++)
+    {
+        splits[i].push_back(0);
+        for (auto& splitter: splitters)
+        {
+            splits[i].push_back(find_split<Record>(buffers[i], splitter));
+        }
+        splits[i].push_back(buffers[i].totalSize);
+    }
+
+    std::vector<MergeRange> ranges(splitters.size() + 1);
+    for (size_t r = 0; r < ranges.size(); r++)
+    {
+        for (size_t i = 0; i < buffers.size(); i++)
+        {
+            size_t start = splits[i][r];
+            size_t end = splits[i][r + 1];
+            ranges[r].groups.push_back(MergeGroup{ start, end - start });
+        }
+    }
+    ranges = remove_empty_ranges(ranges);
+    compute_write_offsets(ranges);
+    timerSplit.print("Merge split");
+
+    size_t refill = range_refill(ranges.size());
+    size_t writeSize = range_write_count(ranges.size());
+    std::cerr << "Merge ranges: " << ranges.size() << ", read buffer: " << range_read_memory(refill) << std::endl;
+
+#pragma omp parallel for num_threads(ranges.size()) schedule(dynamic)
+    for (size_t r = 0; r < ranges.size(); r++)
+    {
+        auto& range = ranges[r];
+        std::vector<ReadBuffer> rangeBuffers;
+        rangeBuffers.reserve(buffers.size());
+
+        for (size_t i = 0; i < buffers.size(); i++)
+        {
+            auto& source = buffers[i];
+            auto& group = range.groups[i];
+            if (!source.reader)
+            {
+                rangeBuffers.emplace_back(source.records<Record>() + group.start, group.count);
+            }
+            else if (r == 0)
+            {
+                // the first range starts at the beginning of every run, reuse the already prefetched buffers
+                rangeBuffers.emplace_back(std::move(source));
+                rangeBuffers.back().limit(group.count);
+            }
+            else if (group.count)
+            {
+                rangeBuffers.emplace_back(std::min(refill, group.count), group.start,
+                        group.count, source.reader, source.index);
+                rangeBuffers.back().read_from_source(refill);
+            }
+            else rangeBuffers.emplace_back(static_cast<Record*>(nullptr), 0);
+        }
+
+        merge_range<Record>(rangeBuffers, range.size(), range.writeStart, writeSize, writer, refill, fences);
+    }
 
     std::cerr << "Merge read IO: " << bufferIORead << std::endl;
     std::cerr << "Merge write IO: " << bufferIOWrite << std::endl;
+    std::cerr << "Merge read-ahead stalls: " << mergeStalls << std::endl;
+}
+
+size_t merge_ranges(size_t memoryLimit, size_t threads)
+{
+    // every range has its own buffers for all runs, fewer ranges leave room for more runs
+    size_t ranges = std::max(static_cast<size_t>(1), threads);
+    while (ranges > 1 && ranges_fan_in(memoryLimit, ranges) < MERGE_MIN_FAN_IN)
+    {
+        ranges--;
+    }
+    return ranges;
+}
+
+size_t merge_fan_in(size_t memoryLimit, size_t threads)
+{
+    return std::max(static_cast<size_t>(2), ranges_fan_in(memoryLimit, merge_ranges(memoryLimit, threads)));
+}
+
+template <typename Record>
+std::vector<FileRecord> merge_cascade(std::vector<FileRecord> files, size_t maxRuns, size_t fanIn, size_t threads)
+{
+    maxRuns = std::max(static_cast<size_t>(1), maxRuns);
+    std::cerr << "Merge plan: " << files.size() << " runs, fan-in " << fanIn << ", final pass " << maxRuns
+              << " runs" << std::endl;
+
+    size_t pass = 0;
+    while (files.size() > maxRuns)
+    {
+        // always merge the smallest runs, just enough of them so that the remaining runs fit into the final pass
+        std::sort(files.begin(), files.end(), [](const FileRecord& lhs, const FileRecord& rhs) {
+            return lhs.count < rhs.count;
+        });
+        size_t runs = std::min(fanIn, files.size() - maxRuns + 1);
+        std::vector<FileRecord> inputs(files.begin(), files.begin() + runs);
+        files.erase(files.begin(), files.begin() + runs);
+
+        Timer timerPass;
+        size_t records = 0;
+        std::vector<MemoryReader> readers;
+        std::vector<ReadBuffer> buffers;
+        readers.reserve(runs);
+        buffers.reserve(runs);
+        for (auto& input: inputs)
+        {
+            if (input.index) readers.emplace_back(input.name.c_str(), 1);
+            else readers.emplace_back(input.name.c_str(), sizeof(Record), get_config().directIO);
+            buffers.emplace_back(get_config().mergeReadBufferCount(), static_cast<size_t>(0), input.count,
+                                 &readers.back(), input.index.get(), input.fences.get());
+            records += input.count;
+        }
+#pragma omp parallel for num_threads(threads)
+        for (size_t i = 0; i < buffers.size(); i++)
+        {
+            buffers[i].read_from_source(get_config().mergeInitialReadCount);
+        }
+
+        std::string out = get_config().writeLocation + "/merge-" + std::to_string(pass);
+        auto fences = std::make_shared<RunFences>(Record::KEY_SIZE, records);
+        merge_files<Record>(inputs, readers, buffers, out, records * sizeof(Record), threads, fences.get());
+        for (auto& input: inputs)
+        {
+            CHECK_NEG_ERROR(unlink(input.name.c_str()));
+        }
+        files.push_back(FileRecord{out, records, nullptr, fences});
+
+        std::cerr << "Merge pass " << pass << ": " << runs << " runs, " << records << " records, "
+                  << (records * sizeof(Record)) / (1024 * 1024) << " MiB in " << timerPass.get() << " ms" << std::endl;
+        pass++;
+    }
+
+    return files;
 }
 
 void compute_write_offsets(std::vector<MergeRange>& ranges)
@@ -133,3 +603,10 @@ std::vector<MergeRange> remove_empty_ranges(const std::vector<MergeRange>& range
 
     return nonEmpty;
 }
+
+#define INSTANTIATE(SIZE, OFFSET, KEY)\
+template void merge_files<FixedRecord<SIZE, OFFSET, KEY>>(std::vector<FileRecord>&, std::vector<MemoryReader>&,\
+        std::vector<ReadBuffer>&, const std::string&, size_t, size_t, RunFences*);\
+template std::vector<FileRecord> merge_cascade<FixedRecord<SIZE, OFFSET, KEY>>(std::vector<FileRecord>, size_t,\
+        size_t, size_t);
+FOR_EACH_RECORD_LAYOUT(INSTANTIATE)
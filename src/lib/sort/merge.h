@@ -5,6 +5,13 @@
 #include "../io/memory-reader.h"
 #include "buffer.h"
 
+// part of a single run that belongs to a merge range, runs (e.g. the outputs of intermediate merges) may have more
+// than 4G records
+struct MergeGroup {
+    size_t start;
+    size_t count;
+};
+
 struct MergeRange {
 public:
     size_t size() const
@@ -17,14 +24,24 @@ public:
         return size;
     }
 
-    std::vector<GroupData> groups;
+    std::vector<MergeGroup> groups;
     size_t writeStart = 0;
 };
 
+template <typename Record>
 void merge_files(std::vector<FileRecord>& files,
                  std::vector<MemoryReader>& readers,
                  std::vector<ReadBuffer>& buffers,
-                 const std::string& outfile, size_t size, size_t threads);
+                 const std::string& outfile, size_t size, size_t threads, RunFences* fences = nullptr);
+
+// number of key ranges (at most threads) that a merge within the given memory limit (in bytes) is split into
+size_t merge_ranges(size_t memoryLimit, size_t threads);
+// maximum number of runs that can be merged at once within the given memory limit (in bytes)
+size_t merge_fan_in(size_t memoryLimit, size_t threads);
+
+// performs intermediate merge passes into new run files until at most maxRuns runs are left
+template <typename Record>
+std::vector<FileRecord> merge_cascade(std::vector<FileRecord> files, size_t maxRuns, size_t fanIn, size_t threads);
 
 void compute_write_offsets(std::vector<MergeRange>& ranges);
 std::vector<MergeRange> remove_empty_ranges(const std::vector<MergeRange>& ranges);
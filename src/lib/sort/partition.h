@@ -0,0 +1,291 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+#include "sort.h"
+#include "../record.h"
+#include "../../settings.h"
+
+// In-place parallel partition of sort keys into the groups of a GroupLayout (block permutation in the style of
+// IPS2Ra). It needs only the output array of SortRecords and small per-thread buffers:
+// 1. every stripe of the input is classified into per-group buffers of B records, full buffers are written as
+//    blocks to the beginning of the stripe in the output
+// 2. the blocks are moved so that the filled blocks of every group area (the B-aligned slots of the group's range)
+//    are at its beginning
+// 3. threads take blocks from the group areas and swap them into the next free slot of their group's area
+// 4. every group writes the records of its partially filled buffers and of its block that overlaps the next group
+//    into the unaligned head and tail of its range
+template <typename Record>
+class GroupPartitioner {
+public:
+    using Item = SortRecord<Record>;
+
+    GroupPartitioner(const GroupLayout<Record>& layout, size_t threads)
+    : layout(layout), groups(layout.size()), stripes(std::max(static_cast<size_t>(1), threads)),
+      blockSize(std::max(static_cast<size_t>(SORT_PARTITION_MIN_BLOCK),
+                         static_cast<size_t>(SORT_PARTITION_BUFFER_SIZE / (layout.size() * sizeof(Item)))))
+    {
+
+    }
+
+    // writes the keys of input[0, count) to data and reorders them by group
+    std::vector<GroupData> partition(const Record* __restrict__ input, Item* __restrict__ data, size_t count)
+    {
+        this->data = data;
+        this->count = count;
+        size_t slots = (count + this->blockSize - 1) / this->blockSize;
+        this->stripeSlots = std::max(static_cast<size_t>(1), (slots + this->stripes - 1) / this->stripes);
+        this->locals.resize(this->stripes);
+
+        this->classify(input);
+        auto groupData = this->plan();
+        this->compact_areas();
+        this->permute_blocks();
+        this->cleanup(groupData);
+        return groupData;
+    }
+
+private:
+    struct Stripe {
+        std::vector<Item> buffers;      // group g is buffered in [g * blockSize, (g + 1) * blockSize)
+        std::vector<uint32_t> fill;     // number of buffered records of every group
+        std::vector<uint32_t> blocks;   // number of written blocks of every group
+        size_t filledEnd = 0;           // end of the written blocks of the stripe
+    };
+
+    size_t stripe_start(size_t stripe) const
+    {
+        return std::min(this->count, stripe * this->stripeSlots * this->blockSize);
+    }
+
+    Item& at(size_t position)
+    {
+        // the block slot that crosses the end of the data is kept in the overflow buffer
+        return this->overflowUsed && position >= this->overflowStart ? this->overflow[position - this->overflowStart]
+                                                                      : this->data[position];
+    }
+
+    void classify(const Record* __restrict__ input)
+    {
+        const size_t B = this->blockSize;
+#pragma omp parallel for num_threads(this->stripes) schedule(static, 1)
+        for (size_t s = 0; s < this->stripes; s++)
+        {
+            auto& local = this->locals[s];
+            local.buffers.resize(this->groups * B);
+            local.fill.assign(this->groups, 0);
+            local.blocks.assign(this->groups, 0);
+
+            size_t write = this->stripe_start(s);
+            size_t end = this->stripe_start(s + 1);
+            for (size_t i = write; i < end; i++)
+            {
+                auto& header = get_header(input[i]);
+                auto group = this->layout.find(header);
+                auto& fill = local.fill[group];
+                local.buffers[group * B + fill] = Item(header, static_cast<uint32_t>(i));
+                if (++fill == B)
+                {
+                    std::memcpy(this->data + write, &local.buffers[group * B], B * sizeof(Item));
+                    write += B;
+                    fill = 0;
+                    local.blocks[group]++;
+                }
+            }
+            local.filledEnd = write;
+        }
+    }
+
+    std::vector<GroupData> plan()
+    {
+        const size_t B = this->blockSize;
+        std::vector<GroupData> groupData(this->groups);
+        this->blocks.assign(this->groups, 0);
+        this->areaStart.resize(this->groups + 1);
+
+        size_t start = 0;
+        for (size_t g = 0; g < this->groups; g++)
+        {
+            size_t groupCount = 0;
+            for (auto& local: this->locals)
+            {
+                groupCount += local.blocks[g] * B + local.fill[g];
+                this->blocks[g] += local.blocks[g];
+            }
+            groupData[g].start = static_cast<uint32_t>(start);
+            groupData[g].count = static_cast<uint32_t>(groupCount);
+            this->areaStart[g] = (start + B - 1) / B * B;
+            start += groupCount;
+        }
+        this->areaStart[this->groups] = (start + B - 1) / B * B;
+
+        this->overflowStart = this->count / B * B;
+        this->overflowUsed = false;
+        this->overflow.resize(B);
+        return groupData;
+    }
+
+    // whether the block slot at position contains a block written by classify
+    bool is_filled(size_t position) const
+    {
+        return position < this->locals[position / (this->stripeSlots * this->blockSize)].filledEnd;
+    }
+
+    // moves the filled blocks of every group area to its beginning
+    void compact_areas()
+    {
+        const size_t B = this->blockSize;
+        this->readEnd.resize(this->groups);
+        this->writeNext.resize(this->groups);
+#pragma omp parallel for num_threads(this->stripes) schedule(dynamic, 16)
+        for (size_t g = 0; g < this->groups; g++)
+        {
+            // only slots that are completely inside the data can contain written blocks
+            size_t begin = this->areaStart[g];
+            size_t end = std::max(begin, std::min(this->areaStart[g + 1], this->overflowStart));
+            size_t empty = begin;
+            size_t filled = end;
+            while (true)
+            {
+                while (empty < filled && this->is_filled(empty)) empty += B;
+                while (filled > empty && !this->is_filled(filled - B)) filled -= B;
+                if (empty >= filled) break;
+                filled -= B;
+                std::memcpy(this->data + empty, this->data + filled, B * sizeof(Item));
+                empty += B;
+            }
+            this->writeNext[g] = begin;
+            this->readEnd[g] = empty;
+        }
+    }
+
+    // blocks in [writeNext, readEnd) of a group area were not moved yet, blocks before writeNext are final
+    void permute_blocks()
+    {
+        const size_t B = this->blockSize;
+        std::vector<std::mutex> locks(this->groups);
+#pragma omp parallel for num_threads(this->stripes) schedule(static, 1)
+        for (size_t s = 0; s < this->stripes; s++)
+        {
+            std::vector<Item> current(B);
+            std::vector<Item> swap(B);
+            for (size_t k = 0; k < this->groups; k++)
+            {
+                size_t source = (s * this->groups / this->stripes + k) % this->groups;
+                while (true)
+                {
+                    {
+                        std::lock_guard<std::mutex> lock(locks[source]);
+                        if (this->readEnd[source] <= this->writeNext[source]) break;
+                        this->readEnd[source] -= B;
+                        std::memcpy(current.data(), this->data + this->readEnd[source], B * sizeof(Item));
+                    }
+
+                    bool placed = false;
+                    while (!placed)
+                    {
+                        size_t target = this->layout.find(current[0]);
+                        std::lock_guard<std::mutex> lock(locks[target]);
+                        size_t slot = this->writeNext[target];
+                        this->writeNext[target] += B;
+                        if (slot < this->readEnd[target])
+                        {
+                            // blocks that already are in their group area stay in place
+                            if (this->layout.find(this->data[slot]) == target) continue;
+                            std::memcpy(swap.data(), this->data + slot, B * sizeof(Item));
+                            std::memcpy(this->data + slot, current.data(), B * sizeof(Item));
+                            std::swap(current, swap);
+                        }
+                        else
+                        {
+                            if (slot + B > this->count)
+                            {
+                                std::copy(current.begin(), current.end(), this->overflow.begin());
+                                this->overflowUsed = true;
+                            }
+                            else std::memcpy(this->data + slot, current.data(), B * sizeof(Item));
+                            placed = true;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    void cleanup(const std::vector<GroupData>& groupData)
+    {
+        const size_t B = this->blockSize;
+
+        // the blocks of a group may reach into the head of the next groups, these records are saved first
+        std::vector<std::vector<Item>> spills(this->groups);
+#pragma omp parallel for num_threads(this->stripes) schedule(dynamic, 16)
+        for (size_t g = 0; g < this->groups; g++)
+        {
+            size_t end = groupData[g].start + groupData[g].count;
+            size_t blocksEnd = this->areaStart[g] + this->blocks[g] * B;
+            for (size_t i = std::max(end, this->areaStart[g]); i < blocksEnd; i++)
+            {
+                spills[g].push_back(this->at(i));
+            }
+        }
+
+#pragma omp parallel for num_threads(this->stripes) schedule(dynamic, 16)
+        for (size_t g = 0; g < this->groups; g++)
+        {
+            size_t start = groupData[g].start;
+            size_t end = start + groupData[g].count;
+            size_t blocksEnd = this->areaStart[g] + this->blocks[g] * B;
+            if (this->overflowUsed && this->overflowStart >= this->areaStart[g] && this->overflowStart < blocksEnd)
+            {
+                // the rest of the overflow block was saved as spill
+                size_t inside = std::min(this->count, end);
+                if (inside > this->overflowStart)
+                {
+                    std::copy(this->overflow.begin(), this->overflow.begin() + (inside - this->overflowStart),
+                              this->data + this->overflowStart);
+                }
+            }
+
+            // free positions: [start, areaStart) and [blocksEnd, end)
+            size_t headEnd = std::min(this->areaStart[g], end);
+            size_t tailStart = std::max(blocksEnd, headEnd);
+            size_t position = start;
+            auto put = [&](const Item* items, size_t n) {
+                for (size_t i = 0; i < n; i++)
+                {
+                    if (position == headEnd) position = tailStart;
+                    this->data[position++] = items[i];
+                }
+            };
+            put(spills[g].data(), spills[g].size());
+            for (auto& local: this->locals)
+            {
+                put(&local.buffers[g * B], local.fill[g]);
+            }
+            assert(position <= headEnd || position == end);
+        }
+    }
+
+    const GroupLayout<Record>& layout;
+    size_t groups;
+    size_t stripes;
+    size_t blockSize;
+
+    Item* data = nullptr;
+    size_t count = 0;
+    size_t stripeSlots = 1;
+    std::vector<Stripe> locals;
+
+    std::vector<size_t> blocks;     // number of blocks of every group
+    std::vector<size_t> areaStart;  // first block slot of every group, the group start rounded up to a block
+    std::vector<size_t> readEnd;
+    std::vector<size_t> writeNext;
+
+    std::vector<Item> overflow;
+    size_t overflowStart = 0;
+    bool overflowUsed = false;
+};
@@ -1,4 +1,5 @@
 #include "radix.h"
+#include <algorithm>
 #include <vector>
 
 #include <cassert>
@@ -6,39 +7,76 @@
 #include <byteswap.h>
 
 #include "../thirdparty/kxsort.h"
+#include "small-sort.h"
 #include "../compare.h"
+#include "../../settings.h"
 
+// sorts a small bucket by ranks of the last 8 key bytes computed with SIMD comparisons
+template <typename Record>
+static void rank_sort(SortRecord<Record>* data, size_t count)
+{
+    alignas(64) uint64_t keys[SMALL_SORT_MAX_COUNT];
+    uint8_t ranks[SMALL_SORT_MAX_COUNT];
+    SortRecord<Record> sorted[SMALL_SORT_MAX_COUNT];
+
+    // the padding is filled first, so that rank_keys never reads keys that were not written
+    size_t padded = (count + 7) & ~static_cast<size_t>(7);
+    std::fill(keys, keys + padded, UINT64_MAX);
+    for (size_t i = 0; i < count; i++)
+    {
+        keys[i] = data[i].key_suffix();
+    }
+    rank_keys(keys, count, ranks);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        sorted[ranks[i]] = data[i];
+    }
+    std::copy(sorted, sorted + count, data);
+}
+
+template <typename Record, int Bytes>
 struct RadixTraitsRowSortRecord
 {
-    static const int nBytes = 9;
+    static const int nBytes = Bytes;
 
-    int kth_byte(const SortRecord& x, int k) {
-        return x.header[KEY_SIZE - 1 - k] & ((unsigned char) 0xFF);
+    int kth_byte(const SortRecord<Record>& x, int k) {
+        return x.key_byte(Record::KEY_SIZE - 1 - k);
+    }
+    bool compare(const SortRecord<Record>& lhs, const SortRecord<Record>& rhs) {
+        return lhs < rhs;
     }
-    bool compare(const SortRecord& lhs, const SortRecord& rhs) {
-        return cmp_header(lhs.header, rhs.header);
+    void base_sort(SortRecord<Record>* s, SortRecord<Record>* e, int remaining) {
+        auto count = static_cast<size_t>(e - s);
+        if (remaining <= 8 && count >= SMALL_SORT_MIN_COUNT && small_sort_available())
+        {
+            rank_sort(s, count);
+        }
+        else kx::insert_sort_core_<SortRecord<Record>*, SortRecord<Record>, RadixTraitsRowSortRecord>(s, e, *this);
     }
 };
+template <typename Record>
 struct RadixTraitsRowRecord
 {
-    static const int nBytes = 9;
+    static const int nBytes = Record::KEY_SIZE - 1;
 
     int kth_byte(const Record& x, int k) {
-        return x[KEY_SIZE - 1 - k] & ((unsigned char) 0xFF);
+        return get_header(x)[Record::KEY_SIZE - 1 - k] & ((unsigned char) 0xFF);
     }
     bool compare(const Record& lhs, const Record& rhs) {
         return cmp_record(lhs, rhs);
     }
 };
 
-void lsd_radix_sort(SortRecord* data, size_t size)
+template <typename Record>
+void lsd_radix_sort(SortRecord<Record>* data, size_t size)
 {
-    int passes = 10;
+    int passes = Record::KEY_SIZE;
 
-    std::vector<SortRecord> buffer(size);
+    std::vector<SortRecord<Record>> buffer(size);
 
-    SortRecord* __restrict__ active = data;
-    SortRecord* __restrict__ next = buffer.data();
+    SortRecord<Record>* __restrict__ active = data;
+    SortRecord<Record>* __restrict__ next = buffer.data();
 
     const int buckets = 256;
 
@@ -48,7 +86,7 @@ void lsd_radix_sort(SortRecord* data, size_t size)
     {
         for (int pass = passes - 1; pass >= 0; pass--)
         {
-            unsigned char radix = active[i].header[pass];
+            unsigned char radix = active[i].key_byte(pass);
             counts[pass * buckets + radix]++;
         }
     }
@@ -66,7 +104,7 @@ void lsd_radix_sort(SortRecord* data, size_t size)
         for (int i = 0 ; i < static_cast<int>(size); i++)
         {
             auto& index = active[i];
-            unsigned char radix = index.header[pass];
+            unsigned char radix = index.key_byte(pass);
             auto target = offsets[radix]++;
             next[target] = index;
         }
@@ -77,11 +115,25 @@ void lsd_radix_sort(SortRecord* data, size_t size)
     assert(active == data);
 }
 
-void msd_radix_sort(SortRecord* data, size_t size)
+template <typename Record>
+void msd_radix_sort(SortRecord<Record>* data, size_t size)
 {
-    kx::radix_sort(data, data + size, RadixTraitsRowSortRecord());
+    kx::radix_sort(data, data + size, RadixTraitsRowSortRecord<Record, Record::KEY_SIZE - 1>());
 }
+template <typename Record>
+void msd_radix_sort_full(SortRecord<Record>* data, size_t size)
+{
+    kx::radix_sort(data, data + size, RadixTraitsRowSortRecord<Record, Record::KEY_SIZE>());
+}
+template <typename Record>
 void msd_radix_sort(Record* data, size_t size)
 {
-    kx::radix_sort(data, data + size, RadixTraitsRowRecord());
+    kx::radix_sort(data, data + size, RadixTraitsRowRecord<Record>());
 }
+
+#define INSTANTIATE(SIZE, OFFSET, KEY)\
+template void lsd_radix_sort<FixedRecord<SIZE, OFFSET, KEY>>(SortRecord<FixedRecord<SIZE, OFFSET, KEY>>*, size_t);\
+template void msd_radix_sort<FixedRecord<SIZE, OFFSET, KEY>>(SortRecord<FixedRecord<SIZE, OFFSET, KEY>>*, size_t);\
+template void msd_radix_sort_full<FixedRecord<SIZE, OFFSET, KEY>>(SortRecord<FixedRecord<SIZE, OFFSET, KEY>>*, size_t);\
+template void msd_radix_sort<FixedRecord<SIZE, OFFSET, KEY>>(FixedRecord<SIZE, OFFSET, KEY>*, size_t);
+FOR_EACH_RECORD_LAYOUT(INSTANTIATE)
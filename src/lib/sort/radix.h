@@ -2,6 +2,13 @@
 
 #include "../record.h"
 
-void lsd_radix_sort(SortRecord* data, size_t size);
-void msd_radix_sort(SortRecord* data, size_t size);
+template <typename Record>
+void lsd_radix_sort(SortRecord<Record>* data, size_t size);
+// sorts by the key without the first byte, all records must share it
+template <typename Record>
+void msd_radix_sort(SortRecord<Record>* data, size_t size);
+// sorts by the whole key
+template <typename Record>
+void msd_radix_sort_full(SortRecord<Record>* data, size_t size);
+template <typename Record>
 void msd_radix_sort(Record* data, size_t size);
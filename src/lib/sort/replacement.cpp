@@ -0,0 +1,441 @@
+#include "sort.h"
+
+#include "../timer.h"
+#include "../compare.h"
+#include "../memory.h"
+#include "../config.h"
+#include "../numa.h"
+#include "../sync.h"
+#include "../io/memory-reader.h"
+#include "../io/file-writer.h"
+#include "../io/worker.h"
+#include "buffer.h"
+#include "merge.h"
+#include "loser-tree.h"
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <vector>
+#include <omp.h>
+
+namespace {
+    // sorted block of input records, stored in arena pages
+    // records [0, nextEnd) belong to the next run, records [begin, end) to the current run
+    struct MiniRun {
+        bool is_dead() const
+        {
+            return this->begin == this->end && this->nextEnd == 0;
+        }
+
+        std::vector<uint32_t> pages;
+        size_t begin = 0;
+        size_t end = 0;
+        size_t nextEnd = 0;
+    };
+
+    // memory divided into pages of 2^shift records, consumed pages of mini-runs are reused by new blocks
+    template <typename Record>
+    class PagedArena {
+    public:
+        PagedArena(Record* data, size_t count, size_t shift): data(data), shift(shift), mask((1ul << shift) - 1)
+        {
+            for (size_t i = 0; i < (count >> shift); i++)
+            {
+                this->freePages.push_back(static_cast<uint32_t>(i));
+            }
+        }
+
+        Record& at(const MiniRun& run, size_t index) const
+        {
+            return this->data[(static_cast<size_t>(run.pages[index >> this->shift]) << this->shift) +
+                              (index & this->mask)];
+        }
+
+        size_t page_size() const
+        {
+            return this->mask + 1;
+        }
+
+        void allocate(MiniRun& run, size_t count)
+        {
+            size_t pages = (count + this->mask) >> this->shift;
+            for (size_t i = 0; i < pages; i++)
+            {
+                run.pages.push_back(this->freePages.back());
+                this->freePages.pop_back();
+            }
+        }
+
+        // returns pages that contain only consumed records of the current run
+        void release(MiniRun& run)
+        {
+            size_t consumed = run.begin == run.end ? SIZE_MAX : run.begin;
+            for (size_t p = run.nextEnd >> this->shift; p < run.pages.size(); p++)
+            {
+                size_t start = p << this->shift;
+                if (start + this->page_size() > consumed) break;
+                if (start >= run.nextEnd && run.pages[p] != UINT32_MAX)
+                {
+                    this->freePages.push_back(run.pages[p]);
+                    run.pages[p] = UINT32_MAX;
+                }
+            }
+        }
+
+        Record* page(const MiniRun& run, size_t p) const
+        {
+            return this->data + (static_cast<size_t>(run.pages[p]) << this->shift);
+        }
+
+        std::vector<uint32_t> freePages;
+
+    private:
+        Record* data;
+        size_t shift;
+        size_t mask;
+    };
+}
+
+// Batched replacement selection. The input is read in blocks that are radix sorted into mini-runs stored in arena
+// pages. Records of a new block that are not smaller than the last written record extend the current run, the rest
+// waits in memory for the next run. Pages are returned to the arena as the merge of the mini-runs consumes them and
+// a new block is loaded as soon as enough pages are free, so on random input the runs are ~2x longer than the memory
+// and on partially sorted input much longer. Records that are left for the next run at the end of the input are
+// merged into a single run at the start of the memory (memoryRunCount records) if they fit into the budget of the
+// in-memory run of the merge, otherwise they are written as the last run.
+template <typename Record>
+static std::vector<FileRecord> generate_runs(MemoryReader& reader, size_t count, Record* memory, size_t memoryCount,
+                                             size_t& memoryRunCount, size_t threads)
+{
+    const size_t blockSize = memoryCount / REPLACEMENT_SELECTION_BLOCKS;
+    size_t shift = 0;
+    while ((2ul << shift) <= std::max(static_cast<size_t>(1), blockSize / REPLACEMENT_SELECTION_PAGES_PER_BLOCK))
+    {
+        shift++;
+    }
+    PagedArena<Record> arena(memory, memoryCount, shift);
+    const size_t pageCount = memoryCount >> shift;
+    const size_t pagesPerBlock = (blockSize + arena.page_size() - 1) / arena.page_size();
+
+    std::vector<MiniRun> runs;
+    HugePageBuffer<Record> staging(blockSize);
+    HugePageBuffer<SortRecord<Record>> sortBuffer(blockSize);
+    numa_distribute(staging.get(), blockSize * sizeof(Record));
+    numa_distribute(sortBuffer.get(), blockSize * sizeof(SortRecord<Record>));
+
+    SyncQueue<IORequest> ioQueue;
+    SyncQueue<size_t> readNotify;
+    SyncQueue<size_t> writeNotify;
+    std::thread ioThread = ioWorker(ioQueue);
+
+    size_t readOffset = 0;  // number of records requested from the input
+    size_t loaded = 0;      // number of records loaded into mini-runs
+    auto readNext = [&]() {
+        size_t toRead = std::min(blockSize, count - readOffset);
+        ioQueue.push(IORequest::read(staging.get(), toRead, readOffset, &readNotify, &reader));
+        readOffset += toRead;
+    };
+    readNext();
+
+    typename Record::Header lastKey{};
+    bool hasLast = false;
+    const Record* lastRecord = nullptr;
+
+    auto load = [&]() {
+        size_t toLoad = readNotify.pop();
+        reader.dontneed(toLoad, loaded);
+
+        MiniRun run;
+        arena.allocate(run, toLoad);
+        sort_records(staging.get(), sortBuffer.get(), toLoad, threads);
+        auto* __restrict__ source = staging.get();
+        auto* __restrict__ sorted = sortBuffer.get();
+#pragma omp parallel for num_threads(threads)
+        for (size_t i = 0; i < toLoad; i++)
+        {
+            arena.at(run, i) = source[sorted[i].index];
+        }
+        loaded += toLoad;
+        if (readOffset < count)
+        {
+            readNext();
+        }
+
+        // find the first record that can still be appended to the current run
+        size_t split = 0;
+        if (hasLast)
+        {
+            size_t high = toLoad;
+            while (split < high)
+            {
+                size_t mid = split + (high - split) / 2;
+                if (cmp_header(get_header(arena.at(run, mid)), lastKey))
+                {
+                    split = mid + 1;
+                }
+                else high = mid;
+            }
+        }
+        run.nextEnd = split;
+        run.begin = split;
+        run.end = toLoad;
+        runs.push_back(std::move(run));
+    };
+
+    std::vector<FileRecord> files;
+    std::unique_ptr<FileWriter> writer;
+    std::shared_ptr<RunFences> fences;
+    bool direct = get_config().directIO;
+    WriteBuffer<Record> outBuffer(get_config().mergeWriteBufferCount, direct);
+    writeNotify.push(0);
+
+    // direct writers count bytes, the records of the run are counted by the buffer
+    auto flush = [&](bool last) {
+        size_t written = writeNotify.pop();
+        if (direct)
+        {
+            fences->add(outBuffer.getActiveBuffer(), outBuffer.processedCount, outBuffer.offset);
+            ioQueue.push(outBuffer.flush_direct(*writer, &writeNotify, last));
+            return;
+        }
+        outBuffer.processedCount += written;
+        fences->add(outBuffer.getActiveBuffer(), outBuffer.processedCount, outBuffer.offset);
+        ioQueue.push(IORequest::write(outBuffer.getActiveBuffer(), outBuffer.offset, outBuffer.processedCount,
+                &writeNotify, writer.get()));
+        outBuffer.swapBuffer();
+        outBuffer.offset = 0;
+    };
+    auto finishRun = [&]() {
+        flush(true);
+        size_t written = writeNotify.pop();
+        files.push_back(FileRecord{ get_config().writeLocation + "/out-" + std::to_string(files.size()),
+                                    outBuffer.processedCount + (direct ? 0 : written), nullptr,
+                                    std::move(fences) });
+        std::cerr << "Run " << files.back().name << ": " << files.back().count << " records" << std::endl;
+        writer.reset();
+        outBuffer.processedCount = 0;
+        writeNotify.push(0);
+    };
+
+    Timer timerRuns;
+    while (true)
+    {
+        if (lastRecord)
+        {
+            // the page of the last written record may be reused now
+            lastKey = get_header(*lastRecord);
+            lastRecord = nullptr;
+        }
+        while (loaded < count && arena.freePages.size() >= pagesPerBlock)
+        {
+            load();
+        }
+        runs.erase(std::remove_if(runs.begin(), runs.end(), [](const MiniRun& run) {
+            return run.is_dead();
+        }), runs.end());
+
+        LoserTree<Record::KEY_SIZE> tree(runs.size());
+        for (size_t i = 0; i < runs.size(); i++)
+        {
+            if (runs[i].begin < runs[i].end)
+            {
+                tree.set(i, get_header(arena.at(runs[i], runs[i].begin)));
+            }
+        }
+        tree.build();
+
+        if (tree.empty())
+        {
+            // the current run is finished
+            if (writer)
+            {
+                finishRun();
+            }
+            if (loaded == count)
+            {
+                // the merged in-memory run needs free pages for its records besides the pages of the mini-runs
+                size_t leftover = 0;
+                size_t leftoverPages = 0;
+                for (auto& run: runs)
+                {
+                    leftover += run.nextEnd;
+                    leftoverPages += (run.nextEnd + arena.page_size() - 1) >> shift;
+                }
+                if (leftover <= get_config().externalInmemoryCount &&
+                    leftoverPages + ((leftover + arena.page_size() - 1) >> shift) <= pageCount) break;
+            }
+
+            for (auto& run: runs)
+            {
+                run.begin = 0;
+                run.end = run.nextEnd;
+                run.nextEnd = 0;
+            }
+            hasLast = false;
+            continue;
+        }
+
+        if (!writer)
+        {
+            writer = std::unique_ptr<FileWriter>(
+                    new FileWriter((get_config().writeLocation + "/out-" + std::to_string(files.size())).c_str(),
+                                   direct ? 1 : sizeof(Record), direct));
+            fences = std::make_shared<RunFences>(Record::KEY_SIZE);
+            if (direct)
+            {
+                outBuffer.start_direct(0);
+            }
+        }
+
+        while (!tree.empty())
+        {
+            auto& run = runs[tree.top()];
+            auto& record = arena.at(run, run.begin++);
+            outBuffer.store(record);
+            outBuffer.offset++;
+            if (EXPECT(outBuffer.needsFlush(), 0))
+            {
+                flush(false);
+            }
+            lastRecord = &record;
+
+            bool exhausted = run.begin == run.end;
+            if (exhausted || (run.begin & (arena.page_size() - 1)) == 0)
+            {
+                arena.release(run);
+            }
+            if (!exhausted)
+            {
+                tree.replace_top(get_header(arena.at(run, run.begin)));
+            }
+            else tree.remove_top();
+
+            if (EXPECT(arena.freePages.size() >= pagesPerBlock && loaded < count, 0)) break;
+        }
+        hasLast = true;
+    }
+    timerRuns.print("Replacement selection");
+
+    ioQueue.push(IORequest::last());
+    ioThread.join();
+
+    // the pages of the mini-runs that are overwritten by the merged run are moved to free pages behind it first
+    memoryRunCount = 0;
+    for (auto& run: runs)
+    {
+        memoryRunCount += run.nextEnd;
+    }
+    size_t boundary = (memoryRunCount + arena.page_size() - 1) >> shift;
+    std::vector<bool> used(pageCount, false);
+    for (auto& run: runs)
+    {
+        for (size_t p = 0; (p << shift) < run.nextEnd; p++)
+        {
+            used[run.pages[p]] = true;
+        }
+    }
+    std::vector<std::pair<uint32_t, uint32_t>> moves;
+    size_t freePage = boundary;
+    for (auto& run: runs)
+    {
+        for (size_t p = 0; (p << shift) < run.nextEnd; p++)
+        {
+            if (run.pages[p] >= boundary) continue;
+            while (used[freePage]) freePage++;
+            used[freePage] = true;
+            moves.emplace_back(run.pages[p], static_cast<uint32_t>(freePage));
+            run.pages[p] = static_cast<uint32_t>(freePage);
+        }
+    }
+#pragma omp parallel for num_threads(threads)
+    for (size_t i = 0; i < moves.size(); i++)
+    {
+        std::memcpy(memory + (static_cast<size_t>(moves[i].second) << shift),
+                    memory + (static_cast<size_t>(moves[i].first) << shift), arena.page_size() * sizeof(Record));
+    }
+
+    Timer timerMemoryRun;
+    LoserTree<Record::KEY_SIZE> tree(runs.size());
+    for (size_t i = 0; i < runs.size(); i++)
+    {
+        runs[i].begin = 0;
+        if (runs[i].nextEnd)
+        {
+            tree.set(i, get_header(arena.at(runs[i], 0)));
+        }
+    }
+    tree.build();
+    auto* __restrict__ target = memory;
+    while (!tree.empty())
+    {
+        auto& run = runs[tree.top()];
+        *target++ = arena.at(run, run.begin++);
+        if (run.begin < run.nextEnd)
+        {
+            tree.replace_top(get_header(arena.at(run, run.begin)));
+        }
+        else tree.remove_top();
+    }
+    timerMemoryRun.print("Memory run");
+
+    return files;
+}
+
+template <typename Record>
+void sort_external_replacement(const std::string& infile, size_t size, const std::string& outfile, size_t threads)
+{
+    Timer externalInit;
+    size_t count = size / sizeof(Record);
+    MemoryReader reader(infile.c_str(), sizeof(Record));
+
+    auto memoryCount = get_config().replacementMemoryCount;
+    HugePageBuffer<Record> memory(memoryCount);
+
+    size_t memoryRunCount;
+    auto files = generate_runs(reader, count, memory.get(), memoryCount, memoryRunCount, threads);
+    std::cerr << "Runs: " << files.size() << " on disk, " << memoryRunCount << " records in memory" << std::endl;
+
+    // only the merged in-memory run is kept, the rest of the memory is used by the merge
+    if (memoryRunCount)
+    {
+        memory.trim(memoryRunCount);
+    }
+    else memory.deallocate();
+
+    size_t fanIn = merge_fan_in(get_config().mergeMemoryLimit, threads);
+    if (files.size() > fanIn - 1)
+    {
+        files = merge_cascade<Record>(files, fanIn - 1, fanIn, threads);
+    }
+
+    std::vector<MemoryReader> readers;
+    std::vector<ReadBuffer> readBuffers;
+    readers.reserve(files.size());
+    readBuffers.reserve(files.size() + 1);
+    for (auto& file: files)
+    {
+        readers.emplace_back(file.name.c_str(), sizeof(Record), get_config().directIO);
+        readBuffers.emplace_back(get_config().mergeReadBufferCount(), static_cast<size_t>(0), file.count,
+                                 &readers.back(), nullptr, file.fences.get());
+    }
+#pragma omp parallel for num_threads(threads)
+    for (size_t i = 0; i < readBuffers.size(); i++)
+    {
+        readBuffers[i].read_from_source(get_config().mergeInitialReadCount);
+    }
+    if (memoryRunCount)
+    {
+        readBuffers.emplace_back(memory.get(), memoryRunCount);
+    }
+    externalInit.print("External init");
+
+    Timer timer;
+    merge_files<Record>(files, readers, readBuffers, outfile, size, threads);
+    timer.print("Merge files");
+}
+
+#define INSTANTIATE(SIZE, OFFSET, KEY)\
+template void sort_external_replacement<FixedRecord<SIZE, OFFSET, KEY>>(const std::string&, size_t,\
+        const std::string&, size_t);
+FOR_EACH_RECORD_LAYOUT(INSTANTIATE)
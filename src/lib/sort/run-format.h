@@ -0,0 +1,202 @@
+#pragma once
+
+#include <cstring>
+#include <vector>
+
+#include "../record.h"
+#include "../io/memory-reader.h"
+#include "../../settings.h"
+
+// Compressed run files store sorted records in blocks of RUN_BLOCK_RECORDS records that are encoded independently.
+// The key of every record is truncated by the prefix that it shares with the previous key of the block:
+// [shared prefix length (1 byte)][key suffix][record bytes without the key]
+// Blocks that would not get smaller are stored raw. The block index is kept in memory by the FileRecord of the run.
+struct RunIndex
+{
+    RunIndex(size_t recordSize, size_t keyOffset, size_t keySize, size_t count)
+    : recordSize(recordSize), keyOffset(keyOffset), keySize(keySize), count(count),
+      raw(this->blocks()), firstKeys(this->blocks() * keySize)
+    {
+
+    }
+
+    size_t blocks() const
+    {
+        return (this->count + RUN_BLOCK_RECORDS - 1) / RUN_BLOCK_RECORDS;
+    }
+    size_t block_count(size_t block) const
+    {
+        return std::min(static_cast<size_t>(RUN_BLOCK_RECORDS), this->count - block * RUN_BLOCK_RECORDS);
+    }
+    size_t block_bytes(size_t block) const
+    {
+        return this->offsets[block + 1] - this->offsets[block];
+    }
+    // upper bound of the encoded size of a block
+    size_t max_block_bytes() const
+    {
+        return RUN_BLOCK_RECORDS * (this->recordSize + 1);
+    }
+    const uint8_t* first_key(size_t block) const
+    {
+        return this->firstKeys.data() + block * this->keySize;
+    }
+
+    size_t recordSize;
+    size_t keyOffset;
+    size_t keySize;
+    size_t count;                   // number of records of the run
+
+    std::vector<uint8_t> raw;       // whether the block is stored without encoding
+    std::vector<uint8_t> firstKeys; // first key of every block
+    std::vector<size_t> offsets;    // file offset of every block, followed by the file size
+};
+
+// Raw runs keep a sparse fence index in memory next to their FileRecord: the first key of every RUN_FENCE_RECORDS
+// records and the last key of the run, so that merge splits are found without searching the file and runs outside
+// of a key range are skipped.
+struct RunFences
+{
+    // without a count, the fences grow with the records that are added (in order)
+    explicit RunFences(size_t keySize, size_t count = 0)
+    : keySize(keySize), count(count), sized(count > 0), lastKey(keySize)
+    {
+        this->firstKeys.resize(this->blocks() * keySize);
+    }
+
+    size_t blocks() const
+    {
+        return (this->count + RUN_FENCE_RECORDS - 1) / RUN_FENCE_RECORDS;
+    }
+    const uint8_t* first_key(size_t block) const
+    {
+        return this->firstKeys.data() + block * this->keySize;
+    }
+    const uint8_t* min_key() const
+    {
+        return this->first_key(0);
+    }
+    const uint8_t* max_key() const
+    {
+        return this->lastKey.data();
+    }
+
+    // records the fences of `count` sorted records that start at position `start` of the run
+    // with a count given to the constructor, disjoint parts of the run may be added in parallel
+    template <typename Record>
+    void add(const Record* records, size_t start, size_t count)
+    {
+        if (!count) return;
+
+        size_t end = start + count;
+        size_t first = (start + RUN_FENCE_RECORDS - 1) / RUN_FENCE_RECORDS * RUN_FENCE_RECORDS;
+        for (size_t position = first; position < end; position += RUN_FENCE_RECORDS)
+        {
+            size_t offset = position / RUN_FENCE_RECORDS * this->keySize;
+            if (this->firstKeys.size() < offset + this->keySize)
+            {
+                this->firstKeys.resize(offset + this->keySize);
+            }
+            std::memcpy(&this->firstKeys[offset], records[position - start].data() + Record::KEY_OFFSET,
+                        this->keySize);
+        }
+        if (!this->sized || end == this->count)
+        {
+            std::memcpy(this->lastKey.data(), records[count - 1].data() + Record::KEY_OFFSET, this->keySize);
+        }
+        if (!this->sized)
+        {
+            this->count = std::max(this->count, end);
+        }
+    }
+
+    size_t keySize;
+    size_t count;                   // number of records of the run
+    bool sized;
+    std::vector<uint8_t> firstKeys; // first key of every RUN_FENCE_RECORDS records
+    std::vector<uint8_t> lastKey;
+};
+
+// encodes count records (in the order given by sorted) into target, returns the number of written bytes
+// target needs RunIndex::max_block_bytes() bytes
+template <typename Record>
+inline size_t encode_block(const Record* records, const SortRecord<Record>* sorted, size_t count, uint8_t* target,
+                           RunIndex& index, size_t block)
+{
+    constexpr size_t KEY_END = Record::KEY_OFFSET + Record::KEY_SIZE;
+    const uint8_t* previous = nullptr;
+    auto* output = target;
+    for (size_t i = 0; i < count; i++)
+    {
+        auto* record = records[sorted[i].index].data();
+        auto* key = record + Record::KEY_OFFSET;
+
+        size_t shared = 0;
+        if (previous)
+        {
+            while (shared < Record::KEY_SIZE && key[shared] == previous[shared]) shared++;
+        }
+        previous = key;
+
+        *output++ = static_cast<uint8_t>(shared);
+        std::memcpy(output, key + shared, Record::KEY_SIZE - shared);
+        output += Record::KEY_SIZE - shared;
+        std::memcpy(output, record, Record::KEY_OFFSET);
+        output += Record::KEY_OFFSET;
+        std::memcpy(output, record + KEY_END, Record::SIZE - KEY_END);
+        output += Record::SIZE - KEY_END;
+    }
+
+    std::memcpy(&index.firstKeys[block * Record::KEY_SIZE], records[sorted[0].index].data() + Record::KEY_OFFSET,
+                Record::KEY_SIZE);
+    size_t size = static_cast<size_t>(output - target);
+    index.raw[block] = size >= count * Record::SIZE;
+    if (index.raw[block])
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            std::memcpy(target + i * Record::SIZE, records[sorted[i].index].data(), Record::SIZE);
+        }
+        size = count * Record::SIZE;
+    }
+    return size;
+}
+
+// decodes records [skip, skip + count) of an encoded block into target
+inline void decode_block(const RunIndex& index, size_t block, const uint8_t* data, size_t skip, size_t count,
+                         uint8_t* target)
+{
+    if (index.raw[block])
+    {
+        std::memcpy(target, data + skip * index.recordSize, count * index.recordSize);
+        return;
+    }
+
+    const size_t keyEnd = index.keyOffset + index.keySize;
+    const size_t rest = index.recordSize - index.keySize;
+    uint8_t key[256];
+    for (size_t i = 0; i < skip + count; i++)
+    {
+        size_t shared = *data++;
+        std::memcpy(key + shared, data, index.keySize - shared);
+        data += index.keySize - shared;
+        if (i >= skip)
+        {
+            std::memcpy(target, data, index.keyOffset);
+            std::memcpy(target + index.keyOffset, key, index.keySize);
+            std::memcpy(target + keyEnd, data + index.keyOffset, index.recordSize - keyEnd);
+            target += index.recordSize;
+        }
+        data += rest;
+    }
+}
+
+// reads and decodes a whole block, reader reads bytes
+inline void read_block(MemoryReader& reader, const RunIndex& index, size_t block, std::vector<uint8_t>& packed,
+                       std::vector<uint8_t>& records)
+{
+    packed.resize(index.block_bytes(block));
+    records.resize(index.block_count(block) * index.recordSize);
+    reader.read_at(packed.data(), packed.size(), index.offsets[block]);
+    decode_block(index, block, packed.data(), 0, index.block_count(block), records.data());
+}
@@ -0,0 +1,73 @@
+#include "small-sort.h"
+
+#include <immintrin.h>
+
+// every key is compared with all other keys (branch-free), its rank is the number of smaller keys
+// and equal keys that precede it
+
+__attribute__((target("avx512f")))
+static void rank_keys_avx512(const uint64_t* keys, size_t count, uint8_t* ranks)
+{
+    size_t padded = (count + 7) & ~static_cast<size_t>(7);
+    for (size_t i = 0; i < count; i++)
+    {
+        __m512i key = _mm512_set1_epi64(static_cast<long long>(keys[i]));
+        size_t rank = 0;
+        for (size_t j = 0; j < padded; j += 8)
+        {
+            __m512i other = _mm512_loadu_si512(keys + j);
+            __mmask8 before = j + 8 <= i ? 0xFF : j < i ? static_cast<__mmask8>((1u << (i - j)) - 1) : 0;
+            rank += __builtin_popcount(_mm512_cmplt_epu64_mask(other, key));
+            rank += __builtin_popcount(_mm512_mask_cmpeq_epu64_mask(before, other, key));
+        }
+        ranks[i] = static_cast<uint8_t>(rank);
+    }
+}
+
+__attribute__((target("avx2")))
+static void rank_keys_avx2(const uint64_t* keys, size_t count, uint8_t* ranks)
+{
+    // AVX2 only compares signed integers
+    const __m256i sign = _mm256_set1_epi64x(static_cast<long long>(1ull << 63));
+    const __m256i lanes = _mm256_set_epi64x(3, 2, 1, 0);
+    size_t padded = (count + 7) & ~static_cast<size_t>(7);
+    for (size_t i = 0; i < count; i++)
+    {
+        __m256i key = _mm256_xor_si256(_mm256_set1_epi64x(static_cast<long long>(keys[i])), sign);
+        __m256i position = _mm256_set1_epi64x(static_cast<long long>(i));
+        size_t rank = 0;
+        for (size_t j = 0; j < padded; j += 4)
+        {
+            __m256i other = _mm256_xor_si256(
+                    _mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys + j)), sign);
+            __m256i before = _mm256_cmpgt_epi64(position,
+                    _mm256_add_epi64(lanes, _mm256_set1_epi64x(static_cast<long long>(j))));
+            __m256i smaller = _mm256_cmpgt_epi64(key, other);
+            __m256i equal = _mm256_and_si256(_mm256_cmpeq_epi64(key, other), before);
+            rank += __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_or_si256(smaller, equal))));
+        }
+        ranks[i] = static_cast<uint8_t>(rank);
+    }
+}
+
+using RankFunction = void (*)(const uint64_t*, size_t, uint8_t*);
+
+static RankFunction select_rank_function()
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return rank_keys_avx512;
+    if (__builtin_cpu_supports("avx2")) return rank_keys_avx2;
+    return nullptr;
+}
+
+static const RankFunction rankFunction = select_rank_function();
+
+bool small_sort_available()
+{
+    return rankFunction != nullptr;
+}
+
+void rank_keys(const uint64_t* keys, size_t count, uint8_t* ranks)
+{
+    rankFunction(keys, count, ranks);
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// maximum number of keys of rank_keys (the insertion sort threshold of kxsort)
+#define SMALL_SORT_MAX_COUNT 64
+
+// whether the CPU supports a vectorized rank_keys (AVX-512 or AVX2, detected at runtime)
+bool small_sort_available();
+
+// computes the position of every key in the sorted order, equal keys keep their order
+// keys has to be padded with UINT64_MAX to a multiple of 8, count <= SMALL_SORT_MAX_COUNT
+void rank_keys(const uint64_t* keys, size_t count, uint8_t* ranks);
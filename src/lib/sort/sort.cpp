@@ -2,7 +2,9 @@
 
 #include "../timer.h"
 #include "radix.h"
+#include "partition.h"
 #include "../util.h"
+#include "../compare.h"
 
 #include <memory>
 #include <cmath>
@@ -10,94 +12,78 @@
 #include <omp.h>
 #include <byteswap.h>
 
-std::vector<GroupData> sort_records(const Record* __restrict__ input, SortRecord* __restrict__ output,
-                                    GroupTarget* targets,
-                                    ssize_t count, size_t threads)
+template <typename Record>
+GroupLayout<Record> sample_group_layout(const Record* input, size_t count, size_t threads)
 {
-    Timer timerGroupInit;
-
-    const int GROUP_COUNT = SORT_GROUP_COUNT;
-    std::vector<GroupData> groupData(GROUP_COUNT);
-    std::vector<std::vector<uint32_t>> counts(static_cast<size_t>(threads));
-
-    for (size_t i = 0; i < threads; i++)
-    {
-        counts[i].resize(static_cast<size_t>(GROUP_COUNT));
-    }
-    timerGroupInit.print("Group init");
+    Timer timerSample;
+    size_t groups = std::min(static_cast<size_t>(SORT_MAX_GROUP_COUNT),
+                             std::max(static_cast<size_t>(SORT_GROUP_COUNT), threads * SORT_GROUPS_PER_THREAD));
 
-    Timer timerMinMax;
-    uint64_t minimum = 0;
-    uint64_t maximum = std::numeric_limits<uint8_t>::max();
-/*#pragma omp parallel for num_threads(threads / 4) reduction(min:minimum) reduction(max:maximum)
-    for (ssize_t i = 0; i < count; i++)
+    GroupLayout<Record> layout;
+    if (count > 0)
     {
-        auto value = input[i][0];
-        minimum = std::min(minimum, value);
-        maximum = std::max(maximum, value);
-    }
-    timerMinMax.print("Group min-max");*/
-
-    uint64_t divisor = std::ceil(((static_cast<uint64_t>(maximum) - static_cast<uint64_t>(minimum)) + 1) / (double) GROUP_COUNT);
-    const auto shift = static_cast<uint32_t>(std::ceil(std::log2(divisor)));
-    std::cerr << "Minimum: " << minimum << ", maximum: " << maximum << ", shift: " << shift << std::endl;
-
-    Timer timerGroupCount;
-#pragma omp parallel num_threads(threads)
-    {
-        auto thread_id = static_cast<size_t>(omp_get_thread_num());
-#pragma omp for
-        for (ssize_t i = 0; i < count; i++)
+        // pseudo-random positions, so that periodic patterns in the input do not skew the sample
+        std::vector<typename GroupLayout<Record>::Key> samples(groups * SORT_SPLITTER_OVERSAMPLING);
+        uint64_t state = 0x9E3779B97F4A7C15ull;
+        for (auto& sample: samples)
         {
-            auto groupIndex = (*reinterpret_cast<const uint8_t*>(&input[i])) >> shift;
-            assert(groupIndex < GROUP_COUNT);
-            targets[i].group = static_cast<uint32_t>(groupIndex);
-            targets[i].index = static_cast<uint32_t>(counts[thread_id][groupIndex]++);
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            sample = make_merge_key(get_header(input[state % count]));
         }
-    }
+        std::sort(samples.begin(), samples.end());
 
-    for (size_t i = 0; i < GROUP_COUNT; i++)
-    {
-        size_t groupCount = 0; // total number of items in this group
-        for (size_t t = 0; t < threads; t++)
+        for (size_t i = 1; i < groups; i++)
         {
-            auto offset = counts[t][i];
-            counts[t][i] = static_cast<uint32_t>(groupCount);
-            groupCount += offset;
+            layout.splitters.push_back(samples[i * SORT_SPLITTER_OVERSAMPLING]);
         }
-        groupData[i].count = static_cast<uint32_t>(groupCount);
-        uint32_t prevStart = i == 0 ? 0 : groupData[i - 1].start;
-        uint32_t prevCount = i == 0 ? 0 : groupData[i - 1].count;
-        groupData[i].start =  prevStart + prevCount;
-
-//        std::cerr << i << ": " << groupData[i].count << ", ";
+        // frequent keys would produce empty groups
+        layout.splitters.erase(std::unique(layout.splitters.begin(), layout.splitters.end()),
+                               layout.splitters.end());
     }
 
-//    std::cerr << std::endl;
-    timerGroupCount.print("Group count");
-
-    Timer timerGroupDivide;
-#pragma omp parallel num_threads(threads)
+    size_t splitter = 0;
+    for (size_t b = 0; b <= 256; b++)
     {
-        auto thread_id = static_cast<size_t>(omp_get_thread_num());
-#pragma omp for
-        for (ssize_t i = 0; i < count; i++)
+        while (splitter < layout.splitters.size() && layout.splitters[splitter].first_byte() < b)
         {
-            auto& group = groupData[targets[i].group];
-            auto targetIndex = group.start + counts[thread_id][targets[i].group] + targets[i].index;
-            output[targetIndex].header = get_header(input[i]);
-            output[targetIndex].index = static_cast<uint32_t>(i);
+            splitter++;
         }
+        layout.byteStart[b] = static_cast<uint32_t>(splitter);
     }
-    timerGroupDivide.print("Group divide");
+    layout.byteStart[256] = static_cast<uint32_t>(layout.splitters.size());
 
-    std::vector<GroupData> nonEmpty;
+    timerSample.print("Group sample");
+    return layout;
+}
+
+template <typename Record>
+std::vector<GroupData> sort_records(const Record* __restrict__ input, SortRecord<Record>* __restrict__ output,
+                                    ssize_t count, size_t threads)
+{
+    return sort_records(input, output, sample_group_layout(input, static_cast<size_t>(count), threads), count,
+                        threads);
+}
+
+template <typename Record>
+std::vector<GroupData> sort_records(const Record* __restrict__ input, SortRecord<Record>* __restrict__ output,
+                                    const GroupLayout<Record>& layout, ssize_t count, size_t threads)
+{
+    std::cerr << "Groups: " << layout.size() << std::endl;
+
+    Timer timerGroupPartition;
+    GroupPartitioner<Record> partitioner(layout, threads);
+    auto groupData = partitioner.partition(input, output, static_cast<size_t>(count));
+    timerGroupPartition.print("Group partition");
+
+    std::vector<size_t> nonEmpty;
     nonEmpty.reserve(groupData.size());
-    for (auto& group: groupData)
+    for (size_t i = 0; i < groupData.size(); i++)
     {
-        if (group.count > 0)
+        if (groupData[i].count > 0)
         {
-            nonEmpty.push_back(group);
+            nonEmpty.push_back(i);
         }
     }
 
@@ -105,16 +91,21 @@ std::vector<GroupData> sort_records(const Record* __restrict__ input, SortRecord
 #pragma omp parallel for num_threads(threads) schedule(dynamic)
     for (size_t i = 0; i < nonEmpty.size(); i++)
     {
-        auto& group = nonEmpty[i];
-        msd_radix_sort(output + group.start, group.count);
+        auto& group = groupData[nonEmpty[i]];
+        if (layout.shares_first_byte(nonEmpty[i]))
+        {
+            msd_radix_sort(output + group.start, group.count);
+        }
+        else msd_radix_sort_full(output + group.start, group.count);
     }
     timerGroupSort.print("Group sort");
 
     return groupData;
 }
+template <typename Record>
 std::vector<GroupData> sort_records_direct(
-        const SortRecord* __restrict__ input,
-        SortRecord* __restrict__ output,
+        const SortRecord<Record>* __restrict__ input,
+        SortRecord<Record>* __restrict__ output,
         ssize_t count, size_t threads)
 {
     Timer timerGroupInit;
@@ -145,7 +136,7 @@ std::vector<GroupData> sort_records_direct(
 #pragma omp for
         for (ssize_t i = 0; i < count; i++)
         {
-            auto groupIndex = input[i].header[0] >> shift;
+            auto groupIndex = input[i].key_byte(0) >> shift;
             assert(groupIndex < GROUP_COUNT);
             targets[i].group = static_cast<uint32_t>(groupIndex);
             targets[i].index = static_cast<uint32_t>(counts[thread_id][groupIndex]++);
@@ -201,9 +192,10 @@ std::vector<GroupData> sort_records_direct(
     return groupData;
 }
 
+template <typename Record>
 void sort_records_copy(const Record* __restrict__ input, Record* __restrict__ target,
         GroupTarget* targets,
-        SortRecord* __restrict__ output, ssize_t count, size_t threads)
+        SortRecord<Record>* __restrict__ output, ssize_t count, size_t threads)
 {
     Timer timerGroupInit;
 
@@ -232,7 +224,7 @@ void sort_records_copy(const Record* __restrict__ input, Record* __restrict__ ta
 #pragma omp for
         for (ssize_t i = 0; i < count; i++)
         {
-            auto groupIndex = (bswap_32(*reinterpret_cast<const uint32_t*>(&input[i]))) >> shift;
+            auto groupIndex = (bswap_32(load_u32(get_header(input[i]).data()))) >> shift;
             assert(groupIndex < GROUP_COUNT);
             targets[i].group = static_cast<uint32_t>(groupIndex);
             targets[i].index = static_cast<uint32_t>(counts[thread_id][groupIndex]++);
@@ -268,7 +260,7 @@ void sort_records_copy(const Record* __restrict__ input, Record* __restrict__ ta
         {
             auto& group = groupData[targets[i].group];
             auto targetIndex = group.start + counts[thread_id][targets[i].group] + targets[i].index;
-            output[targetIndex].header = get_header(input[i]);
+            output[targetIndex].set_key(get_header(input[i]));
             output[targetIndex].index = static_cast<uint32_t>(i);
         }
     }
@@ -290,12 +282,13 @@ void sort_records_copy(const Record* __restrict__ input, Record* __restrict__ ta
     timerGroupSort.print("Group sort");
 }
 
-std::vector<std::vector<SortRecord>> sort_records_per_parts(const Record* input, ssize_t count, size_t threads)
+template <typename Record>
+std::vector<std::vector<SortRecord<Record>>> sort_records_per_parts(const Record* input, ssize_t count, size_t threads)
 {
     Timer timerGroupInit;
 
     const int GROUP_COUNT = SORT_GROUP_COUNT;
-    std::vector<std::vector<SortRecord>> groups(GROUP_COUNT);
+    std::vector<std::vector<SortRecord<Record>>> groups(GROUP_COUNT);
     for (auto& group: groups)
     {
         group.reserve(count / GROUP_COUNT);
@@ -307,11 +300,11 @@ std::vector<std::vector<SortRecord>> sort_records_per_parts(const Record* input,
 #pragma omp parallel num_threads(16)
     for (ssize_t i = 0; i < count; i++)
     {
-        auto groupIndex = input[i][0] >> shift;
+        auto groupIndex = get_header(input[i])[0] >> shift;
         if (groupIndex / 4 == omp_get_thread_num())
         {
             assert(groupIndex < GROUP_COUNT);
-            groups[groupIndex].emplace_back(*(reinterpret_cast<const Header*>(&input[i])), i);
+            groups[groupIndex].emplace_back(get_header(input[i]), i);
         }
     }
 
@@ -328,3 +321,19 @@ std::vector<std::vector<SortRecord>> sort_records_per_parts(const Record* input,
 
     return groups;
 }
+
+#define INSTANTIATE(SIZE, OFFSET, KEY)\
+template GroupLayout<FixedRecord<SIZE, OFFSET, KEY>> sample_group_layout(\
+        const FixedRecord<SIZE, OFFSET, KEY>*, size_t, size_t);\
+template std::vector<GroupData> sort_records(const FixedRecord<SIZE, OFFSET, KEY>*,\
+        SortRecord<FixedRecord<SIZE, OFFSET, KEY>>*, ssize_t, size_t);\
+template std::vector<GroupData> sort_records(const FixedRecord<SIZE, OFFSET, KEY>*,\
+        SortRecord<FixedRecord<SIZE, OFFSET, KEY>>*, const GroupLayout<FixedRecord<SIZE, OFFSET, KEY>>&,\
+        ssize_t, size_t);\
+template std::vector<GroupData> sort_records_direct(const SortRecord<FixedRecord<SIZE, OFFSET, KEY>>*,\
+        SortRecord<FixedRecord<SIZE, OFFSET, KEY>>*, ssize_t, size_t);\
+template void sort_records_copy(const FixedRecord<SIZE, OFFSET, KEY>*, FixedRecord<SIZE, OFFSET, KEY>*,\
+        GroupTarget*, SortRecord<FixedRecord<SIZE, OFFSET, KEY>>*, ssize_t, size_t);\
+template std::vector<std::vector<SortRecord<FixedRecord<SIZE, OFFSET, KEY>>>> sort_records_per_parts(\
+        const FixedRecord<SIZE, OFFSET, KEY>*, ssize_t, size_t);
+FOR_EACH_RECORD_LAYOUT(INSTANTIATE)
@@ -1,8 +1,13 @@
 #pragma once
 
+#include <algorithm>
+#include <memory>
 #include <vector>
+#include <string>
+#include <sys/types.h>
 
 #include "../record.h"
+#include "../compare.h"
 #include "../../settings.h"
 
 struct GroupData
@@ -11,10 +16,15 @@ struct GroupData
     uint32_t count;
 };
 
+struct RunIndex;
+struct RunFences;
+
 struct FileRecord
 {
     std::string name;
     size_t count = 0;
+    std::shared_ptr<RunIndex> index;   // block index of a compressed run, the file contains raw records if empty
+    std::shared_ptr<RunFences> fences; // fence keys of a raw run
 };
 
 struct OverlapRange {
@@ -38,27 +48,94 @@ struct OverlapRange {
 struct GroupTarget
 {
     uint32_t index;
-    uint8_t group;
+    uint16_t group;
 } __attribute__((packed));
 
+// key ranges of the top-level partition of sort_records
+// group i contains keys in [splitters[i - 1], splitters[i]), the first and the last group are unbounded
+template <typename Record>
+struct GroupLayout
+{
+    using Key = MergeKey<Record::KEY_SIZE>;
+
+    size_t size() const
+    {
+        return this->splitters.size() + 1;
+    }
+
+    size_t find(const typename Record::Header& header) const
+    {
+        return this->find(make_merge_key(header));
+    }
+    size_t find(const SortRecord<Record>& record) const
+    {
+        Key key;
+        key.prefix = record.prefix;
+        key.tail = record.tail;
+        return this->find(key);
+    }
+    size_t find(const Key& key) const
+    {
+        // only splitters with the same first byte as the key need to be compared
+        auto first = key.first_byte();
+        auto it = std::upper_bound(this->splitters.begin() + this->byteStart[first],
+                                   this->splitters.begin() + this->byteStart[first + 1], key);
+        return static_cast<size_t>(it - this->splitters.begin());
+    }
+
+    // all keys of the group share the first byte, so the group sort can skip it
+    bool shares_first_byte(size_t group) const
+    {
+        return group > 0 && group < this->splitters.size() &&
+               this->splitters[group - 1].first_byte() == this->splitters[group].first_byte();
+    }
+
+    std::vector<Key> splitters;
+    uint32_t byteStart[257];   // splitters with first byte b are [byteStart[b], byteStart[b + 1])
+};
+
+// chooses splitters of (approximately) equally sized groups from a sample of the input keys
+template <typename Record>
+GroupLayout<Record> sample_group_layout(const Record* input, size_t count, size_t threads);
+
+template <typename Record>
 void sort_inmemory(const std::string& infile, size_t size, const std::string& outfile, size_t threads);
+template <typename Record>
 void sort_inmemory_overlapped(const std::string& infile, size_t size, const std::string& outfile, size_t threads);
+template <typename Record>
+void sort_inmemory_inplace(const std::string& infile, size_t size, const std::string& outfile, size_t threads);
+template <typename Record>
 void sort_inmemory_distribute(const std::string& infile, size_t size, const std::string& outfile, size_t threads);
 
+template <typename Record>
 void sort_external(const std::string& infile, size_t size, const std::string& outfile, size_t threads);
+template <typename Record>
+void sort_external_replacement(const std::string& infile, size_t size, const std::string& outfile, size_t threads);
+template <typename Record>
 void sort_external_records(const std::string& infile, size_t size, const std::string& outfile, size_t threads);
 
-std::vector<GroupData> sort_records(const Record* __restrict__ input, SortRecord* __restrict__ output,
-                                    GroupTarget* targets,
+// newline-delimited or length-prefixed records (see Config::format), in-memory or external
+void sort_varlen(const std::string& infile, size_t size, const std::string& outfile, size_t threads);
+
+// output receives the sorted keys of input, the partition into groups is done in place in output
+template <typename Record>
+std::vector<GroupData> sort_records(const Record* __restrict__ input, SortRecord<Record>* __restrict__ output,
                                     ssize_t count, size_t threads);
+// sorts with the given top-level partition, groups with the same index contain the same key range in every call
+template <typename Record>
+std::vector<GroupData> sort_records(const Record* __restrict__ input, SortRecord<Record>* __restrict__ output,
+                                    const GroupLayout<Record>& layout, ssize_t count, size_t threads);
+template <typename Record>
 void sort_records_copy(const Record* input,
         Record* target,
         GroupTarget* targets,
-        SortRecord* output, ssize_t count, size_t threads);
-std::vector<GroupData> sort_records_direct(const SortRecord* input, SortRecord* output,
+        SortRecord<Record>* output, ssize_t count, size_t threads);
+template <typename Record>
+std::vector<GroupData> sort_records_direct(const SortRecord<Record>* input, SortRecord<Record>* output,
                                     ssize_t count, size_t threads);
-std::vector<std::vector<SortRecord>> sort_records_per_parts(const Record* __restrict__ input,
-                                                            ssize_t count, size_t threads);
+template <typename Record>
+std::vector<std::vector<SortRecord<Record>>> sort_records_per_parts(const Record* __restrict__ input,
+                                                                    ssize_t count, size_t threads);
 
 template <typename T>
 inline std::vector<size_t> prefix_sum(const std::vector<std::vector<T>>& data)
@@ -0,0 +1,584 @@
+#include "sort.h"
+
+#include "../timer.h"
+#include "../compare.h"
+#include "../memory.h"
+#include "../config.h"
+#include "../sync.h"
+#include "../io/memory-reader.h"
+#include "../io/file-writer.h"
+#include "../io/worker.h"
+#include "../thirdparty/kxsort.h"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <memory>
+#include <queue>
+#include <vector>
+#include <byteswap.h>
+#include <omp.h>
+
+namespace {
+    // entry of the offset index of variable-length records
+    // records are ordered bytewise by their whole payload, the cached prefix decides most comparisons
+    struct VarRecord {
+        uint64_t prefix;    // first 8 payload bytes, big-endian and zero padded
+        uint64_t offset;    // offset of the payload in the chunk
+        uint32_t length;    // payload length
+    } __attribute__((packed));
+
+    inline uint64_t load_prefix(const uint8_t* data, size_t length)
+    {
+        uint8_t bytes[8] = {};
+        std::memcpy(bytes, data, std::min(length, sizeof(bytes)));
+        return bswap_64(load_u64(bytes));
+    }
+
+    inline bool cmp_payload(const uint8_t* lhs, size_t lhsLength, const uint8_t* rhs, size_t rhsLength)
+    {
+        int result = std::memcmp(lhs, rhs, std::min(lhsLength, rhsLength));
+        return result < 0 || (result == 0 && lhsLength < rhsLength);
+    }
+
+    inline bool cmp_var(const uint8_t* data, const VarRecord& lhs, const VarRecord& rhs)
+    {
+        if (lhs.prefix != rhs.prefix) return lhs.prefix < rhs.prefix;
+        return cmp_payload(data + lhs.offset, lhs.length, data + rhs.offset, rhs.length);
+    }
+
+    // sorts by the prefix without its first byte, all records must share it
+    struct RadixTraitsVarRecord
+    {
+        static const int nBytes = 7;
+
+        int kth_byte(const VarRecord& x, int k) {
+            return static_cast<int>((x.prefix >> (8 * k)) & 0xFF);
+        }
+        bool compare(const VarRecord& lhs, const VarRecord& rhs) {
+            return cmp_var(this->data, lhs, rhs);
+        }
+
+        const uint8_t* data;
+    };
+
+    inline size_t frame_overhead(RecordFormat format)
+    {
+        return format == RecordFormat::Lines ? 1 : sizeof(uint32_t);
+    }
+
+    inline uint8_t* store_frame(uint8_t* target, const uint8_t* payload, uint32_t length, RecordFormat format)
+    {
+        if (format == RecordFormat::LengthPrefixed)
+        {
+            std::memcpy(target, &length, sizeof(length));
+            target += sizeof(length);
+        }
+        std::memcpy(target, payload, length);
+        target += length;
+        if (format == RecordFormat::Lines)
+        {
+            *target++ = '\n';
+        }
+        return target;
+    }
+
+    // sequential reader of a spill run of length-prefixed records
+    class RunReader {
+    public:
+        RunReader(const std::string& path, size_t size, size_t bufferSize)
+        : reader(path.c_str(), 1), size(size), buffer(bufferSize)
+        {
+
+        }
+
+        // moves to the next record, returns false at the end of the run
+        bool next()
+        {
+            if (!this->ensure(sizeof(uint32_t))) return false;
+            std::memcpy(&this->length, this->buffer.data() + this->position, sizeof(uint32_t));
+            this->position += sizeof(uint32_t);
+            if (!this->ensure(this->length))
+            {
+                std::cerr << "Truncated run" << std::endl;
+                std::exit(1);
+            }
+            this->payload = this->buffer.data() + this->position;
+            this->position += this->length;
+            this->prefix = load_prefix(this->payload, this->length);
+            return true;
+        }
+
+        bool operator<(const RunReader& other) const
+        {
+            if (this->prefix != other.prefix) return this->prefix < other.prefix;
+            return cmp_payload(this->payload, this->length, other.payload, other.length);
+        }
+
+        const uint8_t* payload = nullptr;
+        uint32_t length = 0;
+
+    private:
+        // makes sure that the next `bytes` bytes are in the buffer, the payload of the current record is invalidated
+        bool ensure(size_t bytes)
+        {
+            if (this->end - this->position >= bytes) return true;
+
+            std::memmove(this->buffer.data(), this->buffer.data() + this->position, this->end - this->position);
+            this->end -= this->position;
+            this->position = 0;
+            if (bytes > this->buffer.size())
+            {
+                this->buffer.resize(bytes);
+            }
+
+            size_t toRead = std::min(this->buffer.size() - this->end, this->size - this->readOffset);
+            this->reader.read_at(this->buffer.data() + this->end, toRead, this->readOffset);
+            this->readOffset += toRead;
+            this->end += toRead;
+            return this->end >= bytes;
+        }
+
+        MemoryReader reader;
+        size_t size;
+        size_t readOffset = 0;
+
+        std::vector<uint8_t> buffer;
+        size_t position = 0;
+        size_t end = 0;
+        uint64_t prefix = 0;
+    };
+
+    // double buffered output of records, full buffers are written by the IO worker
+    class FrameWriter {
+    public:
+        FrameWriter(const std::string& path, size_t bufferSize, RecordFormat format, SyncQueue<IORequest>& ioQueue)
+        : writer(path.c_str(), 1), format(format), ioQueue(ioQueue), capacity(bufferSize)
+        {
+            this->buffers[0].allocate(bufferSize);
+            this->buffers[1].allocate(bufferSize);
+            this->notify.push(0);
+        }
+
+        void write(const uint8_t* payload, uint32_t length)
+        {
+            size_t frame = length + frame_overhead(this->format);
+            if (EXPECT(this->used + frame > this->capacity, 0))
+            {
+                this->flush();
+                if (frame > this->capacity)
+                {
+                    // records larger than the buffer are written directly
+                    this->notify.pop();
+                    std::vector<uint8_t> data(frame);
+                    store_frame(data.data(), payload, length, this->format);
+                    this->writer.write_at(data.data(), frame, this->offset);
+                    this->offset += frame;
+                    this->notify.push(0);
+                    return;
+                }
+            }
+            store_frame(this->buffers[this->active].get() + this->used, payload, length, this->format);
+            this->used += frame;
+        }
+
+        void finish()
+        {
+            this->flush();
+            this->notify.pop();
+            this->writer.preallocate(this->offset);
+        }
+
+        // number of written bytes
+        size_t size() const
+        {
+            return this->offset;
+        }
+
+    private:
+        void flush()
+        {
+            this->notify.pop();
+            this->ioQueue.push(IORequest::write(this->buffers[this->active].get(), this->used, this->offset,
+                                                &this->notify, &this->writer));
+            this->offset += this->used;
+            this->used = 0;
+            this->active = 1 - this->active;
+        }
+
+        FileWriter writer;
+        RecordFormat format;
+        SyncQueue<IORequest>& ioQueue;
+        SyncQueue<size_t> notify;
+
+        HugePageBuffer<uint8_t> buffers[2];
+        size_t active = 0;
+        size_t capacity;
+        size_t used = 0;
+        size_t offset = 0;
+    };
+}
+
+// calls fn(offset, length) for the lines starting in data[start, end)
+// a line without a newline is only complete at the end of the input
+template <typename F>
+static void for_each_line(const uint8_t* data, size_t start, size_t end, bool last, F&& fn)
+{
+    while (start < end)
+    {
+        auto* newline = static_cast<const uint8_t*>(std::memchr(data + start, '\n', end - start));
+        if (!newline && !last) break;
+
+        size_t lineEnd = newline ? static_cast<size_t>(newline - data) : end;
+        if (!fn(start, lineEnd - start)) break;
+        start = lineEnd + 1;
+    }
+}
+
+// indexes at most maxCount lines of data[0, size), returns the number of consumed bytes
+static size_t parse_lines(const uint8_t* data, size_t size, bool last, VarRecord* index, size_t maxCount,
+                          size_t& count, size_t threads)
+{
+    // every thread indexes the lines that start in its part of the data
+    std::vector<size_t> starts(threads + 1, size);
+    starts[0] = 0;
+    for (size_t t = 1; t < threads; t++)
+    {
+        size_t position = std::max(starts[t - 1], t * size / threads);
+        if (position == 0)
+        {
+            starts[t] = 0;
+            continue;
+        }
+        auto* newline = static_cast<const uint8_t*>(std::memchr(data + position - 1, '\n', size - position + 1));
+        starts[t] = newline ? static_cast<size_t>(newline - data) + 1 : size;
+    }
+
+    std::vector<size_t> offsets(threads + 1, 0);
+#pragma omp parallel for num_threads(threads)
+    for (size_t t = 0; t < threads; t++)
+    {
+        size_t lines = 0;
+        for_each_line(data, starts[t], starts[t + 1], last, [&lines](size_t, size_t) {
+            lines++;
+            return true;
+        });
+        offsets[t + 1] = lines;
+    }
+    for (size_t t = 0; t < threads; t++)
+    {
+        offsets[t + 1] += offsets[t];
+    }
+
+#pragma omp parallel for num_threads(threads)
+    for (size_t t = 0; t < threads; t++)
+    {
+        size_t target = offsets[t];
+        for_each_line(data, starts[t], starts[t + 1], last, [&](size_t offset, size_t length) {
+            if (target >= maxCount) return false;
+            index[target++] = VarRecord{ load_prefix(data + offset, length), offset,
+                                         static_cast<uint32_t>(length) };
+            return true;
+        });
+    }
+
+    count = std::min(offsets[threads], maxCount);
+    if (!count) return 0;
+    auto& lastRecord = index[count - 1];
+    return std::min(lastRecord.offset + lastRecord.length + 1, size);
+}
+
+// indexes at most maxCount length-prefixed records of data[0, size), returns the number of consumed bytes
+static size_t parse_length_prefixed(const uint8_t* data, size_t size, VarRecord* index, size_t maxCount,
+                                    size_t& count)
+{
+    size_t offset = 0;
+    count = 0;
+    while (count < maxCount && offset + sizeof(uint32_t) <= size)
+    {
+        uint32_t length;
+        std::memcpy(&length, data + offset, sizeof(length));
+        if (length > size - offset - sizeof(uint32_t)) break;
+
+        offset += sizeof(uint32_t);
+        index[count++] = VarRecord{ load_prefix(data + offset, length), offset, length };
+        offset += length;
+    }
+    return offset;
+}
+
+// sorts the index by the payloads
+// the records are partitioned by the first prefix byte, every group is radix sorted by the rest of the prefix
+// and records with equal prefixes are compared by their whole payload
+static void sort_index(const uint8_t* data, const VarRecord* __restrict__ input, VarRecord* __restrict__ output,
+                       size_t count, size_t threads)
+{
+    std::vector<std::array<size_t, 256>> offsets(threads);
+    std::array<size_t, 257> groups{};
+
+#pragma omp parallel num_threads(threads)
+    {
+        auto& local = offsets[omp_get_thread_num()];
+        local.fill(0);
+
+#pragma omp for schedule(static)
+        for (size_t i = 0; i < count; i++)
+        {
+            local[input[i].prefix >> 56]++;
+        }
+
+#pragma omp single
+        {
+            size_t offset = 0;
+            for (size_t group = 0; group < 256; group++)
+            {
+                groups[group] = offset;
+                for (auto& thread: offsets)
+                {
+                    auto groupCount = thread[group];
+                    thread[group] = offset;
+                    offset += groupCount;
+                }
+            }
+            groups[256] = offset;
+        }
+
+#pragma omp for schedule(static)
+        for (size_t i = 0; i < count; i++)
+        {
+            output[local[input[i].prefix >> 56]++] = input[i];
+        }
+    }
+
+#pragma omp parallel for schedule(dynamic) num_threads(threads)
+    for (size_t group = 0; group < 256; group++)
+    {
+        auto* begin = output + groups[group];
+        auto* end = output + groups[group + 1];
+        kx::radix_sort(begin, end, RadixTraitsVarRecord{ data });
+
+        // the radix sort leaves records with equal prefixes in arbitrary order
+        while (begin < end)
+        {
+            auto* next = begin + 1;
+            while (next < end && next->prefix == begin->prefix) next++;
+            if (next - begin > 1)
+            {
+                std::sort(begin, next, [data](const VarRecord& lhs, const VarRecord& rhs) {
+                    return cmp_var(data, lhs, rhs);
+                });
+            }
+            begin = next;
+        }
+    }
+}
+
+// copies the records to target in the order of the index, returns the number of written bytes
+static size_t gather(const uint8_t* data, const VarRecord* index, size_t count, uint8_t* target,
+                     RecordFormat format, size_t threads)
+{
+    size_t overhead = frame_overhead(format);
+    std::vector<size_t> offsets(threads + 1, 0);
+#pragma omp parallel for num_threads(threads)
+    for (size_t t = 0; t < threads; t++)
+    {
+        size_t bytes = 0;
+        for (size_t i = count * t / threads; i < count * (t + 1) / threads; i++)
+        {
+            bytes += index[i].length + overhead;
+        }
+        offsets[t + 1] = bytes;
+    }
+    for (size_t t = 0; t < threads; t++)
+    {
+        offsets[t + 1] += offsets[t];
+    }
+
+#pragma omp parallel for num_threads(threads)
+    for (size_t t = 0; t < threads; t++)
+    {
+        auto* output = target + offsets[t];
+        for (size_t i = count * t / threads; i < count * (t + 1) / threads; i++)
+        {
+            output = store_frame(output, data + index[i].offset, index[i].length, format);
+        }
+    }
+    return offsets[threads];
+}
+
+// merges the runs into path, the runs share readMemory, returns the number of written bytes
+static size_t merge_pass(const std::vector<FileRecord>& runs, const std::string& path, RecordFormat format,
+                         size_t writeBuffer, size_t readMemory)
+{
+    std::vector<RunReader> readers;
+    readers.reserve(runs.size());
+    for (auto& run: runs)
+    {
+        readers.emplace_back(run.name, run.count, readMemory / runs.size());
+    }
+
+    auto cmp = [&readers](size_t lhs, size_t rhs) {
+        return readers[rhs] < readers[lhs];
+    };
+    std::priority_queue<size_t, std::vector<size_t>, decltype(cmp)> heap(cmp);
+    for (size_t i = 0; i < readers.size(); i++)
+    {
+        if (readers[i].next())
+        {
+            heap.push(i);
+        }
+    }
+
+    size_t bytes;
+    SyncQueue<IORequest> ioQueue;
+    std::thread ioThread = ioWorker(ioQueue);
+    {
+        FrameWriter writer(path, writeBuffer, format, ioQueue);
+        while (!heap.empty())
+        {
+            auto top = heap.top();
+            heap.pop();
+            auto& reader = readers[top];
+            writer.write(reader.payload, reader.length);
+            if (reader.next())
+            {
+                heap.push(top);
+            }
+        }
+        writer.finish();
+        bytes = writer.size();
+    }
+    ioQueue.push(IORequest::last());
+    ioThread.join();
+    return bytes;
+}
+
+// the smallest runs are merged in intermediate passes of at most fanIn runs, until the rest fits into the final pass
+static void merge_runs(std::vector<FileRecord> runs, const std::string& outfile, RecordFormat format)
+{
+    // the output buffers and the read buffers of the runs of a pass share the memory budget
+    auto& config = get_config();
+    size_t writeBuffer = std::min(static_cast<size_t>(VARLEN_WRITE_BUFFER_SIZE), config.bufferMemoryLimit / 8);
+    size_t readMemory = config.bufferMemoryLimit - 2 * writeBuffer;
+    size_t fanIn = std::max(static_cast<size_t>(2), static_cast<size_t>(readMemory / VARLEN_MIN_RUN_BUFFER));
+    std::cerr << "Merge plan: " << runs.size() << " runs, fan-in " << fanIn << std::endl;
+
+    size_t pass = 0;
+    while (runs.size() > fanIn)
+    {
+        std::sort(runs.begin(), runs.end(), [](const FileRecord& lhs, const FileRecord& rhs) {
+            return lhs.count < rhs.count;
+        });
+        size_t count = std::min(fanIn, runs.size() - fanIn + 1);
+        std::vector<FileRecord> inputs(runs.begin(), runs.begin() + count);
+        runs.erase(runs.begin(), runs.begin() + count);
+
+        Timer timerPass;
+        std::string out = config.writeLocation + "/merge-" + std::to_string(pass);
+        size_t bytes = merge_pass(inputs, out, RecordFormat::LengthPrefixed, writeBuffer, readMemory);
+        for (auto& input: inputs)
+        {
+            CHECK_NEG_ERROR(unlink(input.name.c_str()));
+        }
+        runs.push_back(FileRecord{ out, bytes });
+
+        std::cerr << "Merge pass " << pass << ": " << count << " runs, " << bytes << " bytes in "
+                  << timerPass.get() << " ms" << std::endl;
+        pass++;
+    }
+
+    merge_pass(runs, outfile, format, writeBuffer, readMemory);
+}
+
+// Variable-length records are sorted through an index of {key prefix, offset, length} entries that is built while
+// the input is parsed. Only the index is sorted, the payloads are gathered in the output order afterwards. Inputs
+// larger than the memory budget are sorted in chunks, which are spilled as runs of length-prefixed records and merged.
+void sort_varlen(const std::string& infile, size_t size, const std::string& outfile, size_t threads)
+{
+    auto& config = get_config();
+    auto format = config.format;
+    if (!size)
+    {
+        FileWriter(outfile.c_str(), 1).preallocate(0);
+        return;
+    }
+
+    // the chunk, its gathered output and two index arrays share the memory budget
+    size_t chunkSize = std::max(static_cast<size_t>(1), std::min(size, config.bufferMemoryLimit / 4));
+    size_t maxCount = std::max(static_cast<size_t>(1),
+                               std::min(size, config.bufferMemoryLimit / (8 * sizeof(VarRecord))));
+
+    std::vector<FileRecord> runs;
+    {
+        Timer timerRuns;
+        MemoryReader reader(infile.c_str(), 1);
+        HugePageBuffer<uint8_t> chunk(chunkSize);
+        HugePageBuffer<uint8_t> sorted(chunkSize + maxCount * sizeof(uint32_t));
+        HugePageBuffer<VarRecord> index(maxCount);
+        HugePageBuffer<VarRecord> sortedIndex(maxCount);
+
+        SyncQueue<IORequest> ioQueue;
+        SyncQueue<size_t> writeNotify;
+        std::thread ioThread = ioWorker(ioQueue);
+        std::unique_ptr<FileWriter> writer;
+        writeNotify.push(0);
+
+        size_t readOffset = 0;
+        size_t carry = 0;   // unparsed bytes at the beginning of the chunk
+        while (true)
+        {
+            Timer timer;
+            size_t toRead = std::min(chunkSize - carry, size - readOffset);
+            reader.read_at(chunk.get() + carry, toRead, readOffset);
+            readOffset += toRead;
+            size_t available = carry + toRead;
+            bool last = readOffset == size;
+            if (!available) break;
+
+            size_t count;
+            size_t consumed = format == RecordFormat::Lines ?
+                    parse_lines(chunk.get(), available, last, index.get(), maxCount, count, threads) :
+                    parse_length_prefixed(chunk.get(), available, index.get(), maxCount, count);
+            if (!count)
+            {
+                if (last) std::cerr << "Truncated record at the end of the input" << std::endl;
+                else std::cerr << "Record does not fit into the memory budget" << std::endl;
+                std::exit(1);
+            }
+            sort_index(chunk.get(), index.get(), sortedIndex.get(), count, threads);
+
+            // a single chunk is written directly to the output
+            bool single = runs.empty() && last && consumed == available;
+            writeNotify.pop();
+            size_t bytes = gather(chunk.get(), sortedIndex.get(), count, sorted.get(),
+                                  single ? format : RecordFormat::LengthPrefixed, threads);
+
+            std::string name = single ? outfile : config.writeLocation + "/out-" + std::to_string(runs.size());
+            writer = std::unique_ptr<FileWriter>(new FileWriter(name.c_str(), 1));
+            writer->preallocate(bytes);
+            ioQueue.push(IORequest::write(sorted.get(), bytes, 0, &writeNotify, writer.get()));
+            if (!single)
+            {
+                runs.push_back(FileRecord{ name, bytes });
+            }
+            std::cerr << "Run " << name << ": " << count << " records, " << bytes << " bytes in "
+                      << timer.get() << " ms" << std::endl;
+
+            carry = available - consumed;
+            std::memmove(chunk.get(), chunk.get() + consumed, carry);
+        }
+
+        writeNotify.pop();
+        writer.reset();
+        ioQueue.push(IORequest::last());
+        ioThread.join();
+        timerRuns.print("Run generation");
+    }
+
+    if (!runs.empty())
+    {
+        Timer timer;
+        merge_runs(runs, outfile, format);
+        timer.print("Merge runs");
+    }
+}
@@ -32,6 +32,16 @@ public:
         return item;
     }
 
+    bool try_pop(T& item)
+    {
+        std::unique_lock<std::mutex> lock(this->mutex);
+        if (this->queue.empty()) return false;
+
+        item = std::move(this->queue.front());
+        this->queue.pop();
+        return true;
+    }
+
     void waitForEmpty()
     {
         while (!this->queue.empty())
@@ -70,6 +70,20 @@ namespace kx {
         }
     }
 
+    // radix traits may provide base_sort(s, e, remaining) for small buckets in which only the `remaining`
+    // least significant bytes differ, insertion sort is used otherwise
+    template <class RandomIt, class ValueType, class RadixTraits>
+    inline auto base_sort_(RandomIt s, RandomIt e, int remaining, RadixTraits& radix_traits, int)
+        -> decltype(radix_traits.base_sort(s, e, remaining), void())
+    {
+        radix_traits.base_sort(s, e, remaining);
+    }
+    template <class RandomIt, class ValueType, class RadixTraits>
+    inline void base_sort_(RandomIt s, RandomIt e, int, RadixTraits& radix_traits, long)
+    {
+        insert_sort_core_<RandomIt, ValueType, RadixTraits>(s, e, radix_traits);
+    }
+
     template <class RandomIt, class ValueType, class RadixTraits, int kWhichByte>
     inline void radix_sort_core_(RandomIt s, RandomIt e, RadixTraits radix_traits)
     {
@@ -110,7 +124,7 @@ namespace kx {
                             (kWhichByte > 0 ? (kWhichByte - 1) : 0)>
                             (last[i-1], last[i], radix_traits);
                 } else if (count[i] > 1) {
-                    insert_sort_core_<RandomIt, ValueType, RadixTraits>(last[i-1], last[i], radix_traits);
+                    base_sort_<RandomIt, ValueType, RadixTraits>(last[i-1], last[i], kWhichByte, radix_traits, 0);
                 }
             }
         }
@@ -121,7 +135,7 @@ namespace kx {
                                   RadixTraits radix_traits)
     {
         if (e - s <= (int)kInsertSortThreshold)
-            insert_sort_core_<RandomIt, ValueType, RadixTraits>(s, e, radix_traits);
+            base_sort_<RandomIt, ValueType, RadixTraits>(s, e, RadixTraits::nBytes, radix_traits, 0);
         else
             radix_sort_core_<RandomIt, ValueType, RadixTraits, RadixTraits::nBytes - 1>(s, e, radix_traits);
     }
@@ -1,5 +1,4 @@
 #include "util.h"
-#include "compare.h"
 
 #include <unistd.h>
 
@@ -24,21 +23,3 @@ size_t file_size(int handle)
     CHECK_NEG_ERROR(lseek64(handle, pos, SEEK_SET));
     return static_cast<size_t>(size);
 }
-
-bool is_sorted(const Record* records, size_t count)
-{
-    for (size_t i = 1; i < count; i++)
-    {
-        if (!cmp_record(records[i - 1], records[i])) return false;
-    }
-    return true;
-}
-
-bool is_sorted(const SortRecord* records, size_t count)
-{
-    for (size_t i = 1; i < count; i++)
-    {
-        if (!cmp_header(records[i - 1].header, records[i].header)) return false;
-    }
-    return true;
-}
@@ -40,11 +40,11 @@ timer##__LINE__.print(name);
 
 size_t file_size(FILE* file);
 size_t file_size(int handle);
-bool is_sorted(const Record* records, size_t count);
-bool is_sorted(const SortRecord* records, size_t count);
-inline const Header& get_header(const Record& record)
+
+template <typename Record>
+inline const typename Record::Header& get_header(const Record& record)
 {
-    return *(reinterpret_cast<const Header*>(&record));
+    return *(reinterpret_cast<const typename Record::Header*>(record.data() + Record::KEY_OFFSET));
 }
 
 inline void set_cpu(int id)
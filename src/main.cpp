@@ -1,49 +1,111 @@
 #include <iostream>
 #include <omp.h>
+#include <sys/resource.h>
 
 #include <timer.h>
+#include <util.h>
+#include <config.h>
 #include <io/mmap-reader.h>
 #include <io/memory-reader.h>
+#include <io/worker.h>
+#include <numa.h>
 #include <sort/sort.h>
 #include <vector>
 #include "settings.h"
 
+template <typename Record>
 static void sort(const std::string& infile, const std::string& outfile)
 {
     auto threadCount = static_cast<size_t>(omp_get_max_threads());
+    auto& config = get_config();
 
-    MemoryReader reader(infile.c_str());
+    MemoryReader reader(infile.c_str(), sizeof(Record));
 
     auto size = reader.get_size();
     std::cerr << "File size: " << size << std::endl;
 
-    if (size * 2 <= LIMIT_IN_MEMORY_SORT) // input and output fit into memory
+    auto memory = config.bufferMemoryLimit;
+    auto count = size / sizeof(Record);
+    if (count * (2 * sizeof(Record) + sizeof(SortRecord<Record>)) <= memory) // input, sort keys and output fit
     {
         std::cerr << "Sort in-memory" << std::endl;
-        sort_inmemory_overlapped(infile, size, outfile, threadCount);
+        sort_inmemory_overlapped<Record>(infile, size, outfile, threadCount);
     }
-    else if (size <= LIMIT_IN_MEMORY_SORT) // only input fits into memory
+    else if (count * (sizeof(Record) + sizeof(SortRecord<Record>)) <= memory &&
+             count <= UINT32_MAX) // input and its sort keys fit into memory
+    {
+        std::cerr << "Sort in-memory in-place" << std::endl;
+        sort_inmemory_inplace<Record>(infile, size, outfile, threadCount);
+    }
+    else if (size <= memory && count <= UINT32_MAX) // only input fits into memory (sort keys index the whole input)
     {
         std::cerr << "Sort in-memory distribute" << std::endl;
-        sort_inmemory_distribute(infile, size, outfile, threadCount);
+        sort_inmemory_distribute<Record>(infile, size, outfile, threadCount);
+    }
+    else if (config.replacementSelection) // fewer, longer runs (useful for partially sorted inputs)
+    {
+        std::cerr << "Sort external (replacement selection)" << std::endl;
+        sort_external_replacement<Record>(infile, size, outfile, threadCount);
     }
     else // neither input nor output fits into memory
     {
         std::cerr << "Sort external" << std::endl;
-        sort_external(infile, size, outfile, threadCount);
+        sort_external<Record>(infile, size, outfile, threadCount);
     }
 }
 
-int main(int argc, char** argv)
+static void sort_variable(const std::string& infile, const std::string& outfile)
+{
+    auto threadCount = static_cast<size_t>(omp_get_max_threads());
+
+    MemoryReader reader(infile.c_str(), 1);
+    auto size = reader.get_size();
+    std::cerr << "File size: " << size << std::endl;
+
+    std::cerr << "Sort variable-length records" << std::endl;
+    sort_varlen(infile, size, outfile, threadCount);
+}
+
+// the buffer sizes are derived from the memory budget, the peak resident memory of the process has to stay below it
+static void report_peak_memory()
 {
-    if (argc != 3)
+    rusage usage{};
+    CHECK_NEG_ERROR(getrusage(RUSAGE_SELF, &usage));
+    auto peak = static_cast<size_t>(usage.ru_maxrss) * 1024;
+    auto budget = get_config().memoryLimit;
+    std::cerr << "Peak memory: " << peak / (1024 * 1024) << " MiB of " << budget / (1024 * 1024) << " MiB"
+              << std::endl;
+    if (peak > budget)
     {
-        std::cout << "USAGE: " << argv[0] << " [in-file] [outfile]" << std::endl;
-        return 1;
+        std::cerr << "Warning: the peak memory exceeded the memory budget" << std::endl;
     }
+}
 
+int main(int argc, char** argv)
+{
     std::ios::sync_with_stdio(false);
 
-    sort(argv[1], argv[2]);
+    auto files = init_config(argc, argv);
+    set_io_backend(get_config().ioUring ? IOBackend::Uring : IOBackend::Sync);
+    numa_bind_threads(static_cast<size_t>(omp_get_max_threads()));
+
+    auto& config = get_config();
+    if (config.format != RecordFormat::Fixed)
+    {
+        sort_variable(files[0], files[1]);
+        report_peak_memory();
+        return 0;
+    }
+
+    // init_config only accepts compiled layouts
+#define SORT_LAYOUT(SIZE, OFFSET, KEY)\
+    if (config.recordSize == SIZE && config.keyOffset == OFFSET && config.keySize == KEY)\
+    {\
+        sort<FixedRecord<SIZE, OFFSET, KEY>>(files[0], files[1]);\
+    }
+    FOR_EACH_RECORD_LAYOUT(SORT_LAYOUT)
+#undef SORT_LAYOUT
+
+    report_peak_memory();
     return 0;
 }
@@ -2,33 +2,110 @@
 
 #define GIB(x) (x * 1024 * 1024 * 1024ull)
 
-// maximum size of input that will be sorted in-memory
-#define LIMIT_IN_MEMORY_SORT GIB(24)
+// record layouts (record size, key offset, key size in bytes) that the sort kernels are compiled for
+// the layout is selected at runtime (--record-size, --key-offset, --key-size), it has to be listed here
+#define FOR_EACH_RECORD_LAYOUT(F)\
+F(100, 0, 10)\
+F(64, 0, 8)\
+F(128, 0, 16)\
+F(256, 0, 16)
 
-// number of records to buffer before writing to the output
-#define WRITE_BUFFER_COUNT (1024 * 1024ull)
+// memory buffer sizes are derived at runtime from the memory budget (see lib/config.h)
 
+// fraction of the detected memory (physical memory or cgroup limit) used as the memory budget
+#define MEMORY_BUDGET_FRACTION 0.8
+// memory of the process itself (code, thread stacks, IO rings and small buffers), the buffer sizes are derived from
+// the rest of the memory budget
+#define MEMORY_RESERVE (8 * 1024 * 1024ull)
+#define MEMORY_RESERVE_PER_THREAD (1024 * 1024ull)
+// granularity of the allocations of the buffer arena (see lib/memory.h), smaller buffers are mapped separately
+#define ARENA_ALIGNMENT (2 * 1024 * 1024ull)
+
+// default directory for intermediate runs
 #ifdef REAL_RUN
-    #define WRITE_LOCATION (std::string("/output-disk"))
-// number of partially sorted results in external sort
-    #define EXTERNAL_SORT_PARTIAL_COUNT 120000000ull
-    #define EXTERNAL_SORT_INMEMORY_COUNT 120000000ull
+    #define DEFAULT_WRITE_LOCATION "/output-disk"
 #else
-    #define WRITE_LOCATION (std::string("/tmp"))
-    #define EXTERNAL_SORT_PARTIAL_COUNT 10000000ull
-    #define EXTERNAL_SORT_INMEMORY_COUNT 10000000ull
+    #define DEFAULT_WRITE_LOCATION "/tmp"
 #endif
 
+// maximum number of records to buffer before writing to the output
+#define WRITE_BUFFER_MAX_COUNT (1024 * 1024ull)
+
+// replacement selection run generation: memory is filled by this many sorted input blocks,
+// each block is stored in pages that are reused as soon as they are written to a run
+#define REPLACEMENT_SELECTION_BLOCKS 16
+#define REPLACEMENT_SELECTION_PAGES_PER_BLOCK 16
+
 // number of groups used for sort
 #define SORT_GROUP_COUNT 256
+// sort_records chooses the group splitters by sampling, with more groups for more threads
+#define SORT_GROUPS_PER_THREAD 64
+#define SORT_MAX_GROUP_COUNT 4096
+// number of sampled keys per group
+#define SORT_SPLITTER_OVERSAMPLING 16
+// in-place group partition: per-thread buffer size of all groups (in bytes), it determines the size of the moved
+// blocks, and the minimal number of records of a block
+#define SORT_PARTITION_BUFFER_SIZE (1024 * 1024ull)
+#define SORT_PARTITION_MIN_BLOCK 16
+
+// radix sort buckets with at least this many records are sorted by the SIMD rank sort (see small-sort.h)
+// instead of insertion sort
+#define SMALL_SORT_MIN_COUNT 8
 
 // buffer sizes for external merges
-#define MERGE_READ_COUNT (1024 * 650)
-#define MERGE_INITIAL_READ_COUNT (1024 * 1024)
-#define MERGE_READ_BUFFER_COUNT (std::max(MERGE_INITIAL_READ_COUNT, MERGE_READ_COUNT))
-#define MERGE_WRITE_BUFFER_COUNT (1024 * 512)
+// the merge read size is chosen so that MERGE_TARGET_FAN_IN runs fit into the merge memory
+#define MERGE_TARGET_FAN_IN 64
+// the merge is split into fewer key ranges than threads if fewer runs could be merged at once
+#define MERGE_MIN_FAN_IN 8
+#define MERGE_MAX_READ_COUNT (1024 * 650)
 #define MERGE_INMEMORY_SPLIT_PARTS 28
+// minimal buffer size of a single run when the merge is split into parallel key ranges
+#define MERGE_MIN_READ_COUNT (1024 * 16)
+// smallest accepted memory budget, in merge read buffers of MERGE_MIN_READ_COUNT records
+#define MEMORY_MIN_MERGE_BUFFERS 6
+// number of sampled keys per run used to choose the splitters of the parallel merge
+#define MERGE_SPLIT_SAMPLES 256
+// the runs of a merge range are read ahead into a second half of their buffers, the read memory of the range is
+// redistributed among the runs by their share of the merged records, initially the halves get
+// (10 - MERGE_PREFETCH_RESERVE) / 10 of it and the rest is kept for the runs that are drained faster
+#define MERGE_PREFETCH_RESERVE 2
+// the read-ahead of slowly drained runs does not shrink below this many records
+#define MERGE_MIN_REFILL_COUNT (1024 * 4)
+
+// gather of records in sorted order (see lib/gather.h): records are prefetched this many records ahead, the
+// streaming kernels write this many bytes at once, every kernel is timed on this many blocks before one is selected
+#define GATHER_PREFETCH_DISTANCE 16
+#define GATHER_STAGING_SIZE 4096
+#define GATHER_BLOCK_RECORDS 4096ull
+#define GATHER_CALIBRATION_BLOCKS 8
+// blocked gather (--permutation=blocked): size of an output block and of a source window (in bytes)
+#define PERMUTE_BLOCK_SIZE (4 * 1024 * 1024ull)
+#define PERMUTE_WINDOW_SIZE (32 * 1024 * 1024ull)
+// in-place permutation: number of permutation cycles that every thread follows at the same time
+#define PERMUTE_INPLACE_WALKS 16
+// in-place permutation: the stopped walks (each with a stashed record) are resolved once this many are pending
+#define PERMUTE_INPLACE_PENDING_WALKS (64 * 1024ull)
+
+// number of records of an independently encoded block of a compressed run
+#define RUN_BLOCK_RECORDS 1024
+// number of records between the fence keys of a raw run
+#define RUN_FENCE_RECORDS 1024
 
 // number of parts to split the read file into when doing inmemory overlapped sort
 #define INMEMORY_OVERLAP_PARTS 4
 #define INMEMORY_DISTRIBUTE_OVERLAP_PARTS 32
+// inmemory distribute sort: the read thread builds the bucket histogram of every piece of this many bytes,
+// the scatter collects up to this many bytes per bucket in a thread-local buffer before writing them
+#define INMEMORY_DISTRIBUTE_PIECE_SIZE (1024 * 1024ull)
+#define INMEMORY_DISTRIBUTE_COMBINE_SIZE 1024ull
+
+// block size that the buffers, offsets and sizes of O_DIRECT reads and writes are aligned to
+#define DIRECT_IO_ALIGNMENT 4096ull
+
+// io_uring worker: maximum number of in-flight operations and size of a single operation (in bytes)
+#define IO_URING_QUEUE_DEPTH 64
+#define IO_URING_SEGMENT_SIZE (1024 * 1024ull)
+
+// variable-length records: size of the merge output buffer and minimal read buffer of a single run (in bytes)
+#define VARLEN_WRITE_BUFFER_SIZE (16 * 1024 * 1024ull)
+#define VARLEN_MIN_RUN_BUFFER (1024 * 1024ull)